@@ -18,16 +18,37 @@
 #include "functions.h"
 #include "configs.h"
 #include "connections.h"
+#include "md5.h"
+#include "ring.h"
 
 User_conf config;
 int discovery_sock, poole_sock = 0;
 char* server_name = NULL;
 pthread_t thread;
-int num_files = 0, downloading = 0;
-File* files;
-int queue_id = 0;
+int num_files = 0;
+File** files;
+File* transfers[MAX_TRANSFERS];
+Ring ring;
 pthread_mutex_t terminal = PTHREAD_MUTEX_INITIALIZER;
 
+/********************************************************************
+ *
+ * @Purpose: Sends a frame to the Poole. The writing thread sends the checks
+ *           of finished downloads through the same socket, so it is locked.
+ * @Parameters: buffer - The frame to send.
+ * @Return: A null pointer, the buffer is freed once sent.
+ *
+ ********************************************************************/
+char* sendPoole(char* buffer) {
+    int sock = poole_sock;
+
+    lockConnection(sock);
+    buffer = sendFrame(buffer, sock, strlen(buffer));
+    unlockConnection(sock);
+
+    return buffer;
+}
+
 /********************************************************************
  *
  * @Purpose: Establishes a socket connection with the server using the information from the 'config' structure.
@@ -63,78 +84,200 @@ int configConnection(struct sockaddr_in* server) {
 
 /********************************************************************
  *
- * @Purpose: Thread reading data from files being downloaded through message queue.
+ * @Purpose: Builds the path of a file in the downloads folder.
+ * @Parameters: name - The name of the song.
+ *              extension - Appended to the name, "" for the song itself.
+ * @Return: The path.
+ *
+ ********************************************************************/
+char* downloadPath(char* name, char* extension) {
+    char* path = NULL;
+
+    asprintf(&path, "%s/%s%s", config.files_path, name, extension);
+
+    return path;
+}
+
+/********************************************************************
+*
+* @Purpose: Deletes the partial download of a song, so the next download
+*           of it starts from the beginning.
+* @Parameters: name - The name of the song.
+* @Return: ---.
+*
+*******************************************************************/
+void forgetPart(char* name) {
+    char* path = downloadPath(name, PART_EXTENSION);
+
+    unlink(path);
+    free(path);
+    path = downloadPath(name, META_EXTENSION);
+    unlink(path);
+    free(path);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Thread writing the data of the files being downloaded, taken from the ring.
+ *           It runs until a chunk with id -1 is received, and then closes the
+ *           downloads left unfinished, keeping them to be resumed. A chunk
+ *           without data discards the download of its id.
  * @Return: ---.
  *
  ********************************************************************/
 void* downloadSong() {
-    char* buffer = NULL;
-    Msg msg;
+    char* buffer = NULL, *part = NULL, *path = NULL;
+    Chunk chunk;
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGINT);
     pthread_sigmask(SIG_BLOCK, &set, NULL);  
 
-    while (downloading != 0) {
-        msgrcv(queue_id, (struct msgbuf *)&msg, sizeof(Msg) - sizeof(long), 1, 0);
-        char* aux = getString(0, '&', msg.data);
-
-        int id = atoi(aux);
-        int space = 256 - 3 - 9 - (strlen(aux) + 1);
-        
-        for (int i = 0; i < num_files; i++) {
-            if (id == files[i].id) {
-                if (files[i].data_received + space > files[i].file_size) {
-                    space = files[i].file_size - files[i].data_received;
+    while (1) {
+        chunk = popChunk(&ring);
+        if (chunk.id == -1) {
+            for (int i = 0; i < MAX_TRANSFERS; i++) {
+                File* file = __atomic_load_n(&transfers[i], __ATOMIC_ACQUIRE);
+
+                if (file != NULL) {
+                    close(file->fd);
+                    __atomic_store_n(&transfers[i], NULL, __ATOMIC_RELEASE);
+                    __atomic_store_n(&file->fd, 0, __ATOMIC_RELEASE);
                 }
-                files[i].data_received += space;
-                
-                write(files[i].fd, msg.data + strlen(aux) + 1, space);
-
-                if (files[i].data_received >= files[i].file_size) {
-                    close(files[i].fd);
-                    files[i].fd = 0;
-                    downloading--;
-                    char* path;
-                    char* md5 = NULL;
-                    asprintf(&path, "%s/%s", config.files_path, files[i].file_name);
-                    
-                    pthread_mutex_lock(&terminal);
-                    getMd5(path, &md5);
-                    pthread_mutex_unlock(&terminal);
+            }
+            break;
+        }
 
-                    if (md5 == NULL || strcmp(md5, files[i].md5) != 0) {
-                        asprintf(&buffer, "\n%sError in the integrity of %s\n%s", C_RED, files[i].file_name, C_RESET);
-                        print(buffer, &terminal);
-                        free(buffer);
-                        print(BOLD, &terminal);
-                        print("\n$ ", &terminal);
-
-                        asprintf(&buffer, T5_KO, files[i].id);
-                        buffer = sendFrame(buffer, poole_sock, strlen(buffer));
-                    }
-                    else {
-                        asprintf(&buffer, "\n%sSuccessfully downloaded %s\n%s", C_GREEN, files[i].file_name, C_RESET);
-                        print(buffer, &terminal);
-                        free(buffer);
-                        print(BOLD, &terminal);
-                        print("\n$ ", &terminal);
-
-                        asprintf(&buffer, T5_OK, files[i].id);
-                        buffer = sendFrame(buffer, poole_sock, strlen(buffer));
-                    }
-                    free(md5);
-                    path = NULL;
+        int space = chunk.length;
+        File* file = NULL;
+
+        if (chunk.id >= 0 && chunk.id < MAX_TRANSFERS) {
+            file = __atomic_load_n(&transfers[chunk.id], __ATOMIC_ACQUIRE);
+        }
+        // A chunk without data aborts the download, the song changed on the Poole
+        if (file != NULL && chunk.data == NULL) {
+            close(file->fd);
+            __atomic_store_n(&transfers[chunk.id], NULL, __ATOMIC_RELEASE);
+            part = downloadPath(file->file_name, PART_EXTENSION);
+            unlink(part);
+            forgetPart(file->file_name);
+            free(part);
+
+            asprintf(&buffer, "\n%s%s changed while it was sent, download it again\n%s", C_RED, file->file_name, C_RESET);
+            print(buffer, &terminal);
+            free(buffer);
+            print(BOLD, &terminal);
+            print("\n$ ", &terminal);
+            __atomic_store_n(&file->fd, 0, __ATOMIC_RELEASE);
+        }
+        else if (file != NULL) {
+            if (file->data_received + space > file->file_size) {
+                space = file->file_size - file->data_received;
+            }
+            file->data_received += space;
+            
+            write(file->fd, chunk.data, space);
+            // The checksum follows the data, so it is ready with the last byte
+            md5Update(&file->checksum, chunk.data, space);
+
+            if (file->data_received >= file->file_size) {
+                close(file->fd);
+                __atomic_store_n(&transfers[chunk.id], NULL, __ATOMIC_RELEASE);
+                char md5[MD5_HEX];
+
+                md5Final(&file->checksum, md5);
+                part = downloadPath(file->file_name, PART_EXTENSION);
+                path = downloadPath(file->file_name, "");
+                // A song that fails the check is not worth resuming
+                if (strcmp(md5, file->md5) == 0) {
+                    rename(part, path);
                 }
-                break;
+                forgetPart(file->file_name);
+                free(part);
+                free(path);
+
+                if (strcmp(md5, file->md5) != 0) {
+                    asprintf(&buffer, "\n%sError in the integrity of %s\n%s", C_RED, file->file_name, C_RESET);
+                    print(buffer, &terminal);
+                    free(buffer);
+                    print(BOLD, &terminal);
+                    print("\n$ ", &terminal);
+
+                    asprintf(&buffer, T5_KO, file->id);
+                    buffer = sendPoole(buffer);
+                }
+                else {
+                    asprintf(&buffer, "\n%sSuccessfully downloaded %s\n%s", C_GREEN, file->file_name, C_RESET);
+                    print(buffer, &terminal);
+                    free(buffer);
+                    print(BOLD, &terminal);
+                    print("\n$ ", &terminal);
+
+                    asprintf(&buffer, T5_OK, file->id);
+                    buffer = sendPoole(buffer);
+                }
+                // From here on the file belongs to the main thread, which may clear it
+                __atomic_store_n(&file->fd, 0, __ATOMIC_RELEASE);
             }
         }
-        free(aux);
-        aux = NULL;
+        free(chunk.block);
     }
     return NULL;
 }
 
+/********************************************************************
+*
+* @Purpose: Opens the partial download of a new file. A new download starts
+*           an empty one and records the MD5 of the song next to it, a resumed
+*           one keeps the bytes before the offset and adds them to the checksum.
+* @Parameters: file - The new file.
+* @Return: The file descriptor, -1 on error.
+*
+*******************************************************************/
+int openPart(File* file) {
+    char* part = downloadPath(file->file_name, PART_EXTENSION), *meta = NULL, *data = NULL;
+    int fd, fd_meta, done = 0, bytes = 0;
+
+    if (file->offset == 0) {
+        fd = open(part, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+        free(part);
+
+        meta = downloadPath(file->file_name, META_EXTENSION);
+        fd_meta = open(meta, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+        free(meta);
+        if (fd_meta != -1) {
+            write(fd_meta, file->md5, strlen(file->md5));
+            write(fd_meta, "\n", 1);
+            close(fd_meta);
+        }
+
+        return fd;
+    }
+
+    fd = open(part, O_RDWR);
+    free(part);
+    if (fd == -1) {
+        forgetPart(file->file_name);
+        return -1;
+    }
+
+    data = malloc(READER_BUFFER);
+    while (done < file->offset && (bytes = read(fd, data, file->offset - done < READER_BUFFER ? file->offset - done : READER_BUFFER)) > 0) {
+        md5Update(&file->checksum, data, bytes);
+        done += bytes;
+    }
+    free(data);
+
+    // Anything after the offset is written again
+    if (done < file->offset || ftruncate(fd, file->offset) == -1) {
+        close(fd);
+        forgetPart(file->file_name);
+        return -1;
+    }
+
+    return fd;
+}
+
 /********************************************************************
 *
 * @Purpose: Stores the data of the new file received and creates/open the mp3 file.
@@ -143,38 +286,46 @@ void* downloadSong() {
 *
 *******************************************************************/
 void newFile(Frame frame) {
-    File file;
+    File* file = malloc(sizeof(File));
     char* buffer = NULL;
 
-    if (getFileData(frame.data, &file) == 0) {
-        asprintf(&buffer, "\n%s%sDownload started!%s\n", C_RESET, C_GREEN, C_RESET);
+    if (getFileData(frame.data, file) == 0) {
+        if (file->offset > 0) {
+            asprintf(&buffer, "\n%s%sDownload resumed from byte %d!%s\n", C_RESET, C_GREEN, file->offset, C_RESET);
+        }
+        else {
+            asprintf(&buffer, "\n%s%sDownload started!%s\n", C_RESET, C_GREEN, C_RESET);
+        }
         print(buffer, &terminal);
         free(buffer);
 
         asprintf(&buffer, "%s%s\n$ ", C_RESET, BOLD);
         print(buffer, &terminal);
         free(buffer);
-        num_files++;
-        files = realloc(files, sizeof(File) * (num_files));
-        file.data_received = 0;
-
-        char* path;
-        asprintf(&path, "%s/%s", config.files_path, file.file_name);
-        file.fd = open(path, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+        file->data_received = file->offset;
+        md5Init(&file->checksum);
+        file->fd = openPart(file);
 
-        if (file.fd == -1) {
+        if (file->fd == -1 || file->id < 0 || file->id >= MAX_TRANSFERS) {
             asprintf(&buffer, "%s%s\nError creating/opening the mp3 file\n%s", C_RESET, C_RED, C_RESET);
             print(buffer, &terminal);
+            free(buffer);
             print(BOLD, &terminal);
             print("\n$ ", &terminal);
+            if (file->fd != -1) close(file->fd);
+            free(file->file_name);
+            free(file->md5);
+            free(file);
             return;
         }
-        free(path);
 
+        num_files++;
+        files = realloc(files, sizeof(File*) * (num_files));
         files[num_files - 1] = file;
-        downloading++;
+        __atomic_store_n(&transfers[file->id], file, __ATOMIC_RELEASE);
         
-        if (downloading - 1 == 0) {
+        // A single writer for the whole session keeps the chunks in order
+        if (thread == 0) {
             pthread_create(&thread, NULL, downloadSong, NULL);
         }
     }
@@ -184,22 +335,76 @@ void newFile(Frame frame) {
         free(buffer);
         print(BOLD, &terminal);
         print("\n$ ", &terminal);
+        free(file->file_name);
+        free(file->md5);
+        free(file);
+    }
+}
+
+/********************************************************************
+*
+* @Purpose: Stops the writing thread once it has written the chunks already
+*           received. Unfinished downloads are kept to be resumed.
+* @Parameters: ---.
+* @Return: ---.
+*
+*******************************************************************/
+void stopWriter() {
+    if (thread != 0) {
+        Chunk stop = {-1, 0, NULL, NULL};
+        pushChunk(&ring, stop);
+        pthread_join(thread, NULL);
+        thread = 0;
     }
 }
 
 /********************************************************************
 *
-* @Purpose: Send the data from a file being downloaded through message queues to the thread.
+* @Purpose: Passes the data from a file being downloaded to the writing thread.
+*           The frame memory is handed over as it is, without copying it.
 * @Parameters: frame - Frame structure containing the information to be sent.
+*                      It is left empty, unless the data is dropped.
 * @Return: ---.
 *
 *******************************************************************/
-void newData(Frame frame) {
-    Msg msg = {0};
-    msg.mtype = 1;
-    memset(msg.data, 0, sizeof(msg.data));
-    memcpy(msg.data, frame.data, 256 - 12);
-    msgsnd(queue_id, (struct msgbuf *)&msg, sizeof(Msg) - sizeof(long), 0);
+void newData(Frame* frame) {
+    Chunk chunk;
+    char* data = strchr(frame->data, '&');
+
+    if (data == NULL) {
+        return;
+    }
+    data++;
+
+    chunk.id = atoi(frame->data);
+    // Data of a file that could not be opened or was stopped has no one to
+    // write it, and would fill the ring until it blocks the main thread
+    if (thread == 0 || chunk.id < 0 || chunk.id >= MAX_TRANSFERS || __atomic_load_n(&transfers[chunk.id], __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+    chunk.length = frame->data_length - (data - frame->data);
+    chunk.data = data;
+    chunk.block = frame->header;
+    frame->header = NULL;
+    frame->data = NULL;
+
+    pushChunk(&ring, chunk);
+}
+
+/********************************************************************
+*
+* @Purpose: Passes the abort of a file being downloaded to the writing thread,
+*           after the data already received.
+* @Parameters: frame - Frame structure with the id of the file.
+* @Return: ---.
+*
+*******************************************************************/
+void abortData(Frame frame) {
+    Chunk chunk = {atoi(frame.data), 0, NULL, NULL};
+
+    if (thread != 0 && chunk.id >= 0 && chunk.id < MAX_TRANSFERS && __atomic_load_n(&transfers[chunk.id], __ATOMIC_ACQUIRE) != NULL) {
+        pushChunk(&ring, chunk);
+    }
 }
 
 Frame getFrameLoop(int sock) {
@@ -210,7 +415,10 @@ Frame getFrameLoop(int sock) {
             newFile(frame);
         }
         else if (strcmp(frame.header, "FILE_DATA") == 0) {
-            newData(frame);
+            newData(&frame);
+        }
+        else if (strcmp(frame.header, "FILE_ABORT") == 0) {
+            abortData(frame);
         }
         frame = freeFrame(frame);
         frame = readFrame(sock);
@@ -251,10 +459,8 @@ void connection(struct sockaddr_in* poole, struct sockaddr_in discovery, int sel
     }
 
     asprintf(&buffer, T1_BOWMAN, config.user);
-    buffer = sendFrame(buffer, discovery_sock, strlen(buffer));
-
-    //frame = readFrame(discovery_sock);
-    frame = getFrameLoop(discovery_sock);
+    frame = negotiateFrame(buffer, discovery_sock, strlen(buffer));
+    buffer = NULL;
     
     if (frame.type == '1' && strcmp(frame.header, "CON_OK") == 0) {
         server_name = getString(0, '&', frame.data);
@@ -272,6 +478,9 @@ void connection(struct sockaddr_in* poole, struct sockaddr_in discovery, int sel
             asprintf(&buffer, "%sError trying to connect to HAL 9000 system\n%s", C_RED, C_RESET);
             print(buffer, &terminal);
             free(buffer);
+            // Not connected, so the socket is not waited on
+            close(poole_sock);
+            poole_sock = 0;
             
             if (select == 1) {
                 print(BOLD, &terminal);
@@ -281,11 +490,11 @@ void connection(struct sockaddr_in* poole, struct sockaddr_in discovery, int sel
         }
 
         asprintf(&buffer, T1_BOWMAN, config.user);
-        buffer = sendFrame(buffer, poole_sock, strlen(buffer));
-        
         frame = freeFrame(frame);
-        // frame = readFrame(poole_sock);
-        frame = getFrameLoop(poole_sock);
+        lockConnection(poole_sock);
+        frame = negotiateFrame(buffer, poole_sock, strlen(buffer));
+        unlockConnection(poole_sock);
+        buffer = NULL;
 
         if (frame.type == '1' && strcmp(frame.header, "CON_OK") == 0) {
             asprintf(&buffer, "%s%s connected to HAL 9000 system, welcome music lover!\n%s", C_GREEN, config.user, C_RESET);
@@ -319,7 +528,7 @@ void connection(struct sockaddr_in* poole, struct sockaddr_in discovery, int sel
         free(buffer);
     }
     frame = freeFrame(frame);
-    close(discovery_sock);
+    closeConnection(discovery_sock);
     discovery_sock = 0;
 
     if (select == 1) {
@@ -340,17 +549,10 @@ void logout() {
     Frame frame, frame2;
     struct sockaddr_in discovery;
 
-    //joinear threads y acabar download o algo
-    if (thread != 0) pthread_join(thread, NULL);
-
-    if (msgctl(queue_id, IPC_RMID, NULL) == -1) {
-        asprintf(&buffer, "%sError deleting the message queue\n%s", C_RED, C_RESET);
-        print(buffer, &terminal);
-        free(buffer);
-    }
+    stopWriter();
 
     asprintf(&buffer, T6, config.user);
-    buffer = sendFrame(buffer, poole_sock, strlen(buffer));
+    buffer = sendPoole(buffer);
     frame = readFrame(poole_sock);
     
     if (configConnection(&discovery) == -1 || connect(discovery_sock, (struct sockaddr *) &discovery, sizeof(discovery)) < 0) {
@@ -358,14 +560,14 @@ void logout() {
         print(buffer, &terminal);
         free(buffer);
 
-        close(poole_sock);
-        close(discovery_sock);
+        closeConnection(poole_sock);
+        closeConnection(discovery_sock);
         return;
     }
 
     asprintf(&buffer, T6, server_name);
-    buffer = sendFrame(buffer, discovery_sock, strlen(buffer));
-    frame2 = readFrame(discovery_sock);
+    frame2 = negotiateFrame(buffer, discovery_sock, strlen(buffer));
+    buffer = NULL;
     if (frame.type == '6' && strcmp(frame.header, "CON_OK") == 0 && frame2.type == '6' && strcmp(frame2.header, "CON_OK") == 0) {    
         asprintf(&buffer, "%sThanks for using HAL 9000, see you soon, music lover!\n%s", C_GREEN, C_RESET);                
         print(buffer, &terminal);
@@ -381,8 +583,8 @@ void logout() {
         print(buffer, &terminal);
         free(buffer);
     }
-    close(poole_sock);
-    close(discovery_sock);
+    closeConnection(poole_sock);
+    closeConnection(discovery_sock);
     frame = freeFrame(frame);
     frame2 = freeFrame(frame2);
 }
@@ -400,7 +602,7 @@ void listSongs() {
     Frame frame;
     
     asprintf(&buffer, T2_SONGS);
-    buffer = sendFrame(buffer, poole_sock, strlen(buffer));
+    buffer = sendPoole(buffer);
 
     while (1) {
         // frame = readFrame(poole_sock);
@@ -452,7 +654,7 @@ void listPlaylists() {
     size_t total_bytes = 0;
 
     asprintf(&buffer, T2_PLAYLISTS);
-    buffer = sendFrame(buffer, poole_sock, strlen(buffer));
+    buffer = sendPoole(buffer);
 
     //frame = readFrame(poole_sock);
     frame = getFrameLoop(poole_sock);
@@ -517,6 +719,312 @@ void listPlaylists() {
     frame = freeFrame(frame);
 }
 
+/********************************************************************
+ *
+ * @Purpose: Asks Discovery for the Pooles a song can be downloaded from,
+ *           at most config.sources of them. The Poole of the session goes
+ *           first, as it also sends the ranges the others fail to.
+ * @Parameters: sources - Where the allocated array of Pooles is stored.
+ * @Return: The number of Pooles.
+ *
+ ********************************************************************/
+int getSources(Source** sources) {
+    struct sockaddr_in discovery = configServer(config.ip, config.port);
+    char* buffer = NULL, *entry = NULL, *save = NULL, *ip = NULL;
+    int sock, num = 0;
+    Source aux;
+    Frame frame;
+
+    *sources = NULL;
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return 0;
+    }
+    if (connect(sock, (struct sockaddr *) &discovery, sizeof(discovery)) < 0) {
+        close(sock);
+        return 0;
+    }
+
+    asprintf(&buffer, T1_POOLE_LIST);
+    frame = negotiateFrame(buffer, sock, strlen(buffer));
+    if (frame.type == '1' && strcmp(frame.header, "POOLES_RESPONSE") == 0) {
+        for (entry = strtok_r(frame.data, "#", &save); entry != NULL; entry = strtok_r(NULL, "#", &save)) {
+            if (strchr(entry, '&') == NULL || strchr(strchr(entry, '&') + 1, '&') == NULL) {
+                continue;
+            }
+            *sources = realloc(*sources, sizeof(Source) * (num + 1));
+            (*sources)[num].name = getString(0, '&', entry);
+            ip = getString(1 + strlen((*sources)[num].name), '&', entry);
+            (*sources)[num].address = configServer(ip, atoi(entry + 2 + strlen((*sources)[num].name) + strlen(ip)));
+            free(ip);
+
+            if (server_name != NULL && strcmp((*sources)[num].name, server_name) == 0) {
+                aux = (*sources)[0];
+                (*sources)[0] = (*sources)[num];
+                (*sources)[num] = aux;
+            }
+            num++;
+        }
+    }
+    frame = freeFrame(frame);
+    closeConnection(sock);
+
+    while (num > config.sources) {
+        num--;
+        free((*sources)[num].name);
+    }
+
+    return num;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Downloads a range of a split song from its Poole, through a
+ *           connection of its own, writing it in place with pwrite.
+ * @Parameters: arg - The range. Its size, md5, received and done are filled.
+ * @Return: ---.
+ *
+ ********************************************************************/
+void* fetchRange(void* arg) {
+    Range* range = (Range*) arg;
+    File* file = range->split->file;
+    Source* source = &range->split->sources[range->source];
+    File info;
+    Frame frame;
+    char* buffer = NULL, *data = NULL;
+    int sock, start, end, length, expected = 0;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    range->done = 0;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return NULL;
+    }
+    if (connect(sock, (struct sockaddr *) &source->address, sizeof(source->address)) < 0) {
+        close(sock);
+        return NULL;
+    }
+
+    asprintf(&buffer, T1_BOWMAN, config.user);
+    frame = negotiateFrame(buffer, sock, strlen(buffer));
+    if (frame.type != '1' || strcmp(frame.header, "CON_OK") != 0) {
+        frame = freeFrame(frame);
+        closeConnection(sock);
+        return NULL;
+    }
+    frame = freeFrame(frame);
+
+    asprintf(&buffer, T3_RANGE_SONG, file->file_name, range->part, range->parts);
+    buffer = sendFrame(buffer, sock, strlen(buffer));
+    frame = readFrame(sock);
+    if (frame.type == '4' && strcmp(frame.header, "NEW_FILE") == 0) {
+        if (getFileData(frame.data, &info) == 0) {
+            range->size = info.file_size;
+            snprintf(range->md5, MD5_HEX, "%s", info.md5);
+            start = info.offset;
+            end = (int) ((long long) info.file_size * (range->part + 1) / range->parts);
+            // The first Poole answering gives the size shown in the progress
+            __atomic_compare_exchange_n(&file->file_size, &expected, info.file_size, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            frame = freeFrame(frame);
+
+            while (start + range->received < end) {
+                frame = readFrame(sock);
+                if (frame.type != '4' || strcmp(frame.header, "FILE_DATA") != 0 || (data = strchr(frame.data, '&')) == NULL) {
+                    break;
+                }
+                data++;
+                length = frame.data_length - (data - frame.data);
+                if (length > end - start - range->received) {
+                    length = end - start - range->received;
+                }
+                if (pwrite(file->fd, data, length, start + range->received) != length) {
+                    break;
+                }
+                range->received += length;
+                __atomic_add_fetch(&file->data_received, length, __ATOMIC_RELAXED);
+                frame = freeFrame(frame);
+            }
+            range->done = start + range->received == end;
+
+            // The whole song is checked once every range is in
+            asprintf(&buffer, range->done ? T5_OK : T5_KO, info.id);
+            buffer = sendFrame(buffer, sock, strlen(buffer));
+        }
+        free(info.file_name);
+        free(info.md5);
+    }
+    frame = freeFrame(frame);
+
+    // Leaves like a user logging out, once the Poole stops sending
+    asprintf(&buffer, T6, config.user);
+    buffer = sendFrame(buffer, sock, strlen(buffer));
+    frame = readFrame(sock);
+    while (frame.type == '4') {
+        frame = freeFrame(frame);
+        frame = readFrame(sock);
+    }
+    frame = freeFrame(frame);
+    closeConnection(sock);
+
+    return NULL;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Thread downloading a song split in one range per Pooles at
+ *           once. The ranges that fail, or come from a Poole with another
+ *           MD5 for the song, are downloaded again from the Poole of the
+ *           session. The file is only kept if its MD5 checks.
+ * @Parameters: arg - The split download. It is freed.
+ * @Return: ---.
+ *
+ ********************************************************************/
+void* splitDownload(void* arg) {
+    Split* split = (Split*) arg;
+    File* file = split->file;
+    int parts = split->num_sources, reference = -1, done = 1;
+    pthread_t* threads = malloc(sizeof(pthread_t) * parts);
+    int* started = calloc(parts, sizeof(int));
+    Range* ranges = calloc(parts, sizeof(Range));
+    char* buffer = NULL, *part = NULL, *path = NULL;
+    char md5[MD5_HEX];
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (int i = 0; i < parts; i++) {
+        ranges[i].split = split;
+        ranges[i].source = i;
+        ranges[i].part = i;
+        ranges[i].parts = parts;
+        started[i] = pthread_create(&threads[i], NULL, fetchRange, &ranges[i]) == 0;
+    }
+    for (int i = 0; i < parts; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+
+    // Every range has to match the Poole of the session, or the first one that worked
+    for (int i = 0; i < parts && reference == -1; i++) {
+        if (ranges[i].done) reference = i;
+    }
+    for (int i = 0; i < parts && reference != -1; i++) {
+        if (!ranges[i].done || ranges[i].size != ranges[reference].size || strcmp(ranges[i].md5, ranges[reference].md5) != 0) {
+            __atomic_sub_fetch(&file->data_received, ranges[i].received, __ATOMIC_RELAXED);
+            ranges[i].source = ranges[reference].source;
+            ranges[i].received = 0;
+            fetchRange(&ranges[i]);
+            done = done && ranges[i].done;
+        }
+    }
+
+    part = downloadPath(file->file_name, PART_EXTENSION);
+    path = downloadPath(file->file_name, "");
+    if (reference != -1 && done && md5Fd(file->fd, md5) == 0 && strcmp(md5, ranges[reference].md5) == 0 && rename(part, path) == 0) {
+        asprintf(&buffer, "\n%sSuccessfully downloaded %s from %d Pooles\n%s", C_GREEN, file->file_name, parts, C_RESET);
+    }
+    else {
+        unlink(part);
+        asprintf(&buffer, "\n%sError downloading %s from several Pooles\n%s", C_RED, file->file_name, C_RESET);
+    }
+    print(buffer, &terminal);
+    free(buffer);
+    print(BOLD, &terminal);
+    print("\n$ ", &terminal);
+    free(part);
+    free(path);
+
+    if (reference != -1) {
+        file->md5 = strdup(ranges[reference].md5);
+    }
+    close(file->fd);
+    // From here on the file belongs to the main thread, which may clear it
+    __atomic_store_n(&file->fd, 0, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < split->num_sources; i++) {
+        free(split->sources[i].name);
+    }
+    free(split->sources);
+    free(split);
+    free(ranges);
+    free(started);
+    free(threads);
+
+    return NULL;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Starts downloading a song from several Pooles at once, if
+ *           Discovery knows more than one.
+ * @Parameters: song - The name of the song.
+ * @Return: 0 if the download was handled, -1 if it has to go through the
+ *          Poole of the session alone.
+ *
+ ********************************************************************/
+int startSplit(char* song) {
+    char* buffer = NULL, *path = NULL;
+    Source* sources = NULL;
+    Split* split = NULL;
+    File* file = NULL;
+    pthread_t split_thread;
+    int num_sources = getSources(&sources);
+
+    if (num_sources < 2) {
+        for (int i = 0; i < num_sources; i++) {
+            free(sources[i].name);
+        }
+        free(sources);
+        return -1;
+    }
+
+    // Ranges arrive out of order, so a split download is never resumed
+    path = downloadPath(song, META_EXTENSION);
+    unlink(path);
+    free(path);
+    file = calloc(1, sizeof(File));
+    file->file_name = strdup(song);
+    file->id = -1;
+    path = downloadPath(song, PART_EXTENSION);
+    file->fd = open(path, O_RDWR | O_TRUNC | O_CREAT, 0666);
+    free(path);
+
+    split = malloc(sizeof(Split));
+    split->file = file;
+    split->sources = sources;
+    split->num_sources = num_sources;
+    if (file->fd == -1 || pthread_create(&split_thread, NULL, splitDownload, split) != 0) {
+        asprintf(&buffer, "%s%s\nError creating/opening the mp3 file\n%s", C_RESET, C_RED, C_RESET);
+        print(buffer, &terminal);
+        free(buffer);
+        if (file->fd != -1) close(file->fd);
+        for (int i = 0; i < num_sources; i++) {
+            free(sources[i].name);
+        }
+        free(sources);
+        free(split);
+        free(file->file_name);
+        free(file);
+        return 0;
+    }
+    pthread_detach(split_thread);
+
+    num_files++;
+    files = realloc(files, sizeof(File*) * (num_files));
+    files[num_files - 1] = file;
+
+    asprintf(&buffer, "\n%s%sDownload started from %d Pooles!%s\n", C_RESET, C_GREEN, num_sources, C_RESET);
+    print(buffer, &terminal);
+    free(buffer);
+
+    return 0;
+}
+
 /********************************************************************
  *
  * @Purpose: Sends a download command to the Poole server for a given song.
@@ -525,15 +1033,34 @@ void listPlaylists() {
  *
  ********************************************************************/
 void downloadCommand(char* song) {
-    char* buffer = NULL;
+    char* buffer = NULL, *path = NULL, *md5 = NULL;
+    struct stat st;
+    int fd;
 
     if (song[strlen(song) - 4] == '.') {
-        asprintf(&buffer, T3_DOWNLOAD_SONG, song);
+        // A partial download of the song is resumed where it was left
+        path = downloadPath(song, META_EXTENSION);
+        fd = open(path, O_RDONLY);
+        free(path);
+        if (fd == -1 && config.sources > 1 && startSplit(song) == 0) {
+            return;
+        }
+        path = downloadPath(song, PART_EXTENSION);
+        if (fd != -1 && stat(path, &st) == 0 && st.st_size > 0) {
+            readLine(fd, &md5);
+            asprintf(&buffer, T3_RESUME_SONG, song, (int) st.st_size, md5);
+            free(md5);
+        }
+        else {
+            asprintf(&buffer, T3_DOWNLOAD_SONG, song);
+        }
+        if (fd != -1) close(fd);
+        free(path);
     } 
     else {
         asprintf(&buffer, T3_DOWNLOAD_LIST, song);
     }
-    buffer = sendFrame(buffer, poole_sock, strlen(buffer));
+    buffer = sendPoole(buffer);
 }
 
 /********************************************************************
@@ -548,39 +1075,39 @@ void checkDownloads() {
     int printed = 0;
     
     for (int i = 0; i < num_files; i++) {
-        if (files[i].fd != -1) {
-            asprintf(&buffer, "%s", files[i].file_name);
-            print(buffer, &terminal);
-            free(buffer);
-            
-            int percent = (files[i].data_received * 100) / files[i].file_size;
-            char* space;
-            if (percent < 10) {
-                space = "  ";
-            }
-            else if (percent < 100) {
-                space = " ";
-            }
-            else {
-                space = "";
-            }
-            asprintf(&buffer, "\t%d%% %s|", percent, space);
-            print(buffer, &terminal);
-            
-            int num_hashes = (files[i].data_received * 20) / files[i].file_size;  // Each hash represents 5%
-            for (int j = 0; j < num_hashes; j++) {
-                print("=", &terminal);
-            }
-
-            // Add spaces for the remaining percentage
-            for (int j = num_hashes; j < 20; j++) {
-                print(" ", &terminal);
-            }
+        asprintf(&buffer, "%s", files[i]->file_name);
+        print(buffer, &terminal);
+        free(buffer);
+        
+        // A split download has no size until a Poole answers
+        int size = files[i]->file_size > 0 ? files[i]->file_size : 1;
+        int percent = ((long long) files[i]->data_received * 100) / size;
+        char* space;
+        if (percent < 10) {
+            space = "  ";
+        }
+        else if (percent < 100) {
+            space = " ";
+        }
+        else {
+            space = "";
+        }
+        asprintf(&buffer, "\t%d%% %s|", percent, space);
+        print(buffer, &terminal);
+        
+        int num_hashes = ((long long) files[i]->data_received * 20) / size;  // Each hash represents 5%
+        for (int j = 0; j < num_hashes; j++) {
+            print("=", &terminal);
+        }
 
-            print("%|\n", &terminal);
-            free(buffer);
-            printed++;
+        // Add spaces for the remaining percentage
+        for (int j = num_hashes; j < 20; j++) {
+            print(" ", &terminal);
         }
+
+        print("%|\n", &terminal);
+        free(buffer);
+        printed++;
     }
 
     if (printed == 0) {
@@ -598,11 +1125,20 @@ void checkDownloads() {
  *
  ********************************************************************/
 void clearDownloads() {
+    int kept = 0;
+
+    // Finished files are no longer used by the writer, so they can be freed
     for (int i = 0; i < num_files; i++) {
-        if (files[i].fd == 0) {
-            files[i].fd = -1;
+        if (__atomic_load_n(&files[i]->fd, __ATOMIC_ACQUIRE) == 0) {
+            free(files[i]->file_name);
+            free(files[i]->md5);
+            free(files[i]);
+        }
+        else {
+            files[kept++] = files[i];
         }
     }
+    num_files = kept;
     
     checkDownloads();
 }
@@ -611,7 +1147,8 @@ void clearDownloads() {
  *
  * @Purpose: Checks for incoming frames from the Poole server and handles them.
  * @Parameters: ---.
- * @Return: 0 if successful, 6 if the server initiated shutdown.
+ * @Return: 0 if successful, 6 if the server initiated shutdown or the
+ *         connection was lost.
  *
  ********************************************************************/
 int checkFrame() {
@@ -625,23 +1162,42 @@ int checkFrame() {
             newFile(frame);
         }
         else if (strcmp(frame.header, "FILE_DATA") == 0) {
-            newData(frame);
+            newData(&frame);
+        }
+        else if (strcmp(frame.header, "FILE_ABORT") == 0) {
+            abortData(frame);
         }
     }          
     else if (frame.type == '6' && strcmp(frame.header, "SHUTDOWN") == 0) {
+        // The rest of the songs being sent will not arrive
+        stopWriter();
         asprintf(&buffer, T6_OK);
-        buffer = sendFrame(buffer, poole_sock, strlen(buffer));
+        buffer = sendPoole(buffer);
         asprintf(&buffer, "\n%s%sServer %s got unexpectedly disconnected\n%s", C_RESET, C_RED, frame.data, C_RESET);
         print(buffer, &terminal);
         free(buffer);
         buffer = NULL;
 
-        close(poole_sock);
+        closeConnection(poole_sock);
         poole_sock = 0;
         frame = freeFrame(frame);
         
         return 6;
     }
+    else if (frame.type == '\0') {
+        // Dropped without SHUTDOWN, the unfinished songs are kept all the same
+        stopWriter();
+        asprintf(&buffer, "\n%s%sLost the connection with %s\n%s", C_RESET, C_RED, server_name, C_RESET);
+        print(buffer, &terminal);
+        free(buffer);
+        buffer = NULL;
+
+        closeConnection(poole_sock);
+        poole_sock = 0;
+        frame = freeFrame(frame);
+
+        return 6;
+    }
     else {
         asprintf(&buffer, "%s%s\nReceived wrong frame\n%s", C_RESET, C_RED, C_RESET);
         print(buffer, &terminal);
@@ -671,8 +1227,9 @@ void sig_handler(int sigsum) {
                 logout();
             }
             for(int i = 0; i < num_files; i++) {
-                free(files[i].file_name);
-                free(files[i].md5);
+                free(files[i]->file_name);
+                free(files[i]->md5);
+                free(files[i]);
             }
             free(files);
             free(server_name);
@@ -698,7 +1255,6 @@ void sig_handler(int sigsum) {
  ********************************************************************/
 int main(int argc, char *argv[]) {
     char *buffer = NULL;
-    key_t key;
     thread = 0;
 
     struct sockaddr_in discovery, poole;
@@ -716,6 +1272,14 @@ int main(int argc, char *argv[]) {
     config = readConfigBow(argv[1]);
     checkName(&config.user);
 
+    if (initRing(&ring) == -1) {
+        asprintf(&buffer, "%sError creating the download ring\n%s", C_RED, C_RESET);
+        print(buffer, &terminal);
+        free(buffer);
+
+        return -1;
+    }
+
     asprintf(&buffer, "%s user initialized\n", config.user);
     print(buffer, &terminal);
     free(buffer);
@@ -725,13 +1289,17 @@ int main(int argc, char *argv[]) {
     print("\n$ ", &terminal);
 
     while(1) {
+        struct timeval no_wait = {0, 0};
+        int buffered = poole_sock != 0 && frameReady(poole_sock);
+
         FD_ZERO(&readfds);
         FD_SET(poole_sock, &readfds);
         FD_SET(0, &readfds);
 
-        int ready = select(FD_SETSIZE, &readfds, NULL, NULL, NULL);
+        // Frames already buffered must not wait for the socket to be readable again
+        int ready = select(FD_SETSIZE, &readfds, NULL, NULL, buffered ? &no_wait : NULL);
 
-        if (ready <= 0) {
+        if (ready < 0) {
             asprintf(&buffer, "%sERROR: Select failed.\n%s", C_RED, C_RESET);
             print(buffer, &terminal);
             free(buffer);
@@ -816,14 +1384,6 @@ int main(int argc, char *argv[]) {
                         removeWhiteSpaces(&buffer);
                         char* song = getSongName(buffer);
 
-                        if (queue_id == 0) {
-                            if (configQueue(&key, &queue_id) == -1) {
-                                asprintf(&buffer, "%sError creating queue\n%s", C_RED, C_RESET);
-                                print(buffer, &terminal);
-                                free(buffer);
-                            }
-                        }
-
                         downloadCommand(song);
                         free(buffer);
                         buffer = NULL;
@@ -871,7 +1431,7 @@ int main(int argc, char *argv[]) {
                 print(BOLD, &terminal);
                 print("\n$ ", &terminal);
             } 
-            else if (FD_ISSET(poole_sock, &readfds)) {
+            else if (buffered || FD_ISSET(poole_sock, &readfds)) {
                 int res = checkFrame();
                 if (res == 6) {
                     connection(&poole, discovery, 1);
@@ -879,16 +1439,14 @@ int main(int argc, char *argv[]) {
                 }
             }
         }
-        if (downloading == 0 && thread != 0) {
-            pthread_join(thread, NULL);
-            thread = 0;
-        }
     }
 
     end:
+    destroyRing(&ring);
     for(int i = 0; i < num_files; i++) {
-        free(files[i].file_name);
-        free(files[i].md5);
+        free(files[i]->file_name);
+        free(files[i]->md5);
+        free(files[i]);
     }
     free(files);
     free(server_name);
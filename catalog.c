@@ -0,0 +1,773 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - Song Catalog
+ * @Authors: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains the functions to load the songs and playlists of a
+ *   Poole once, look them up by name, and reload them when their files change.
+ *
+ * - They are kept in a binary catalog file generated from the text files,
+ *   which is mapped in memory and searched by name with binary searches.
+ *
+ * - Requests take a reference to the current catalog, so a reload swaps the
+ *   pointer and the old catalog is freed when its last reference is released.
+ *
+ ********************************************************************/
+#include "catalog.h"
+
+static Catalog* current = NULL;
+static pthread_mutex_t catalog_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t watcher;
+static int watching = 0, fd_notify = -1;
+static char* catalog_folder = NULL;
+
+/********************************************************************
+ *
+ * @Purpose: Compares two names by their bytes, a prefix goes first.
+ * @Parameters: a - The first name.
+ *              a_length - Length of the first name.
+ *              b - The second name.
+ *              b_length - Length of the second name.
+ * @Return: Less than, equal to or greater than 0, like strcmp.
+ *
+ ********************************************************************/
+static int compareName(const char* a, int a_length, const char* b, int b_length) {
+    int result = memcmp(a, b, a_length < b_length ? a_length : b_length);
+
+    return result != 0 ? result : a_length - b_length;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Compares two positions of a views array by their names, to sort them.
+ * @Parameters: a - The first position.
+ *              b - The second position.
+ *              views - The views array.
+ * @Return: Less than, equal to or greater than 0, like strcmp.
+ *
+ ********************************************************************/
+static int compareViews(const void* a, const void* b, void* views) {
+    View* first = (View*) views + *(const uint32_t*) a;
+    View* second = (View*) views + *(const uint32_t*) b;
+
+    return compareName(first->data, first->length, second->data, second->length);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Compares two positions of a playlists array by their names, to sort them.
+ * @Parameters: a - The first position.
+ *              b - The second position.
+ *              playlists - The playlists array.
+ * @Return: Less than, equal to or greater than 0, like strcmp.
+ *
+ ********************************************************************/
+static int comparePlaylists(const void* a, const void* b, void* playlists) {
+    View* first = &((Playlist*) playlists)[*(const uint32_t*) a].name;
+    View* second = &((Playlist*) playlists)[*(const uint32_t*) b].name;
+
+    return compareName(first->data, first->length, second->data, second->length);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Finds a song by a name that may not be '\0' terminated.
+ * @Parameters: catalog - The catalog.
+ *              name - The name of the song.
+ *              length - Length of the name.
+ * @Return: Position of the song in the songs array, -1 if it does not exist.
+ *
+ ********************************************************************/
+static int searchSong(Catalog* catalog, const char* name, int length) {
+    int low = 0, high = catalog->num_songs - 1;
+
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        SongRecord* song = &catalog->songs[catalog->song_order[middle]];
+        int result = compareName(catalog->strings + song->name, song->length, name, length);
+
+        if (result == 0) return catalog->song_order[middle];
+        if (result < 0) low = middle + 1;
+        else high = middle - 1;
+    }
+
+    return -1;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Points the arrays of a catalog to the sections of its data.
+ * @Parameters: catalog - The catalog, with its data and size set.
+ * @Return: 0 if the data is a valid catalog file, -1 otherwise.
+ *
+ ********************************************************************/
+static int setSections(Catalog* catalog) {
+    CatalogHeader* header = (CatalogHeader*) catalog->data;
+
+    if (catalog->size < sizeof(CatalogHeader) || header->magic != CATALOG_MAGIC || header->version != CATALOG_VERSION) {
+        return -1;
+    }
+    // Every section has to be inside the file
+    if ((uint64_t) header->songs_offset + (uint64_t) header->num_songs * sizeof(SongRecord) > catalog->size ||
+        (uint64_t) header->playlists_offset + (uint64_t) header->num_playlists * sizeof(PlaylistRecord) > catalog->size ||
+        (uint64_t) header->playlist_songs_offset + (uint64_t) header->num_playlist_songs * sizeof(PlaylistSong) > catalog->size ||
+        (uint64_t) header->song_order_offset + (uint64_t) header->num_songs * sizeof(uint32_t) > catalog->size ||
+        (uint64_t) header->playlist_order_offset + (uint64_t) header->num_playlists * sizeof(uint32_t) > catalog->size ||
+        (uint64_t) header->strings_offset + header->strings_size > catalog->size ||
+        header->strings_size == 0 || catalog->data[header->strings_offset + header->strings_size - 1] != '\0') {
+        return -1;
+    }
+
+    catalog->num_songs = header->num_songs;
+    catalog->num_playlists = header->num_playlists;
+    catalog->songs = (SongRecord*) (catalog->data + header->songs_offset);
+    catalog->playlists = (PlaylistRecord*) (catalog->data + header->playlists_offset);
+    catalog->playlist_songs = (PlaylistSong*) (catalog->data + header->playlist_songs_offset);
+    catalog->song_order = (uint32_t*) (catalog->data + header->song_order_offset);
+    catalog->playlist_order = (uint32_t*) (catalog->data + header->playlist_order_offset);
+    catalog->strings = catalog->data + header->strings_offset;
+
+    return 0;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Checks that the records of a catalog only point inside it, so a
+ *           damaged file is built again instead of being read out of bounds.
+ * @Parameters: catalog - The catalog, with its sections set.
+ * @Return: 0 if every record is valid, -1 otherwise.
+ *
+ ********************************************************************/
+static int checkRecords(Catalog* catalog) {
+    CatalogHeader* header = (CatalogHeader*) catalog->data;
+
+    for (int i = 0; i < catalog->num_songs; i++) {
+        SongRecord* song = &catalog->songs[i];
+
+        if ((uint64_t) song->name + song->length >= header->strings_size || catalog->song_order[i] >= header->num_songs) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < catalog->num_playlists; i++) {
+        PlaylistRecord* playlist = &catalog->playlists[i];
+
+        if ((uint64_t) playlist->name + playlist->length >= header->strings_size ||
+            (uint64_t) playlist->first + playlist->num_songs > header->num_playlist_songs ||
+            catalog->playlist_order[i] >= header->num_playlists) {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < header->num_playlist_songs; i++) {
+        PlaylistSong* song = &catalog->playlist_songs[i];
+
+        if (song->name >= header->strings_size || song->song < -1 || song->song >= catalog->num_songs) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Adds a name to the string table of a catalog being built.
+ * @Parameters: catalog - The catalog.
+ *              used - Bytes of the string table used, moved after the name.
+ *              name - The name.
+ * @Return: Offset of the name in the string table.
+ *
+ ********************************************************************/
+static uint32_t addString(Catalog* catalog, uint32_t* used, View name) {
+    uint32_t offset = *used;
+
+    memcpy(catalog->strings + offset, name.data, name.length);
+    catalog->strings[offset + name.length] = '\0';
+    *used += name.length + 1;
+
+    return offset;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Fills the size, file identity and checksum of the songs of a
+ *           catalog being built.
+ * @Parameters: catalog - The catalog.
+ *              folder - The folder of the songs.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void fillSongs(Catalog* catalog, char* folder) {
+    struct stat st;
+    char* path = NULL, *md5;
+    int fd;
+
+    for (int i = 0; i < catalog->num_songs; i++) {
+        char* name = catalog->strings + catalog->songs[i].name;
+
+        asprintf(&path, "%s/%s", folder, name);
+        fd = open(path, O_RDONLY);
+        free(path);
+        path = NULL;
+        if (fd == -1) {
+            continue;
+        }
+        if (fstat(fd, &st) == 0) {
+            catalog->songs[i].size = st.st_size;
+            catalog->songs[i].inode = st.st_ino;
+            catalog->songs[i].mtime_sec = st.st_mtim.tv_sec;
+            catalog->songs[i].mtime_nsec = st.st_mtim.tv_nsec;
+        }
+        // The checksums cache keeps this cheap unless the song changed
+        md5 = getChecksum(name, fd);
+        if (md5 != NULL) {
+            strcpy(catalog->songs[i].md5, md5);
+            free(md5);
+        }
+        close(fd);
+    }
+}
+
+/********************************************************************
+ *
+ * @Purpose: Builds a catalog file in memory from the text files of a folder.
+ * @Parameters: catalog - Where to build it.
+ *              folder - The folder.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void buildCatalog(Catalog* catalog, char* folder) {
+    Mapping song_map, playlist_map;
+    CatalogHeader header;
+    View* songs;
+    Playlist* playlists;
+    char* file = NULL;
+    int num_songs, num_playlists;
+    uint32_t used = 0, num_playlist_songs = 0, strings_size = 1;
+
+    asprintf(&file, "%s/%s", folder, SONGS_FILE);
+    songs = mapSongs(file, &num_songs, &song_map);
+    free(file);
+    file = NULL;
+    asprintf(&file, "%s/%s", folder, PLAYLISTS_FILE);
+    playlists = mapPlaylists(file, &num_playlists, &playlist_map);
+    free(file);
+
+    for (int i = 0; i < num_songs; i++) {
+        strings_size += songs[i].length + 1;
+    }
+    for (int i = 0; i < num_playlists; i++) {
+        strings_size += playlists[i].name.length + 1;
+        num_playlist_songs += playlists[i].num_songs;
+        for (int j = 0; j < playlists[i].num_songs; j++) {
+            strings_size += playlists[i].songs[j].length + 1;
+        }
+    }
+
+    // Sections one after the other, each one aligned for its records
+    memset(&header, 0, sizeof(CatalogHeader));
+    header.magic = CATALOG_MAGIC;
+    header.version = CATALOG_VERSION;
+    header.num_songs = num_songs;
+    header.num_playlists = num_playlists;
+    header.num_playlist_songs = num_playlist_songs;
+    header.strings_size = strings_size;
+    header.songs_offset = sizeof(CatalogHeader);
+    header.playlists_offset = header.songs_offset + num_songs * sizeof(SongRecord);
+    header.playlist_songs_offset = header.playlists_offset + num_playlists * sizeof(PlaylistRecord);
+    header.song_order_offset = header.playlist_songs_offset + num_playlist_songs * sizeof(PlaylistSong);
+    header.playlist_order_offset = header.song_order_offset + num_songs * sizeof(uint32_t);
+    header.strings_offset = header.playlist_order_offset + num_playlists * sizeof(uint32_t);
+
+    catalog->size = header.strings_offset + strings_size;
+    catalog->data = calloc(1, catalog->size);
+    catalog->mapped = 0;
+    memcpy(catalog->data, &header, sizeof(CatalogHeader));
+    setSections(catalog);
+
+    // The string table holds the song names and then the playlist names, both sorted
+    for (int i = 0; i < num_songs; i++) {
+        catalog->song_order[i] = i;
+    }
+    qsort_r(catalog->song_order, num_songs, sizeof(uint32_t), compareViews, songs);
+    for (int i = 0; i < num_songs; i++) {
+        uint32_t pos = catalog->song_order[i];
+
+        catalog->songs[pos].name = addString(catalog, &used, songs[pos]);
+        catalog->songs[pos].length = songs[pos].length;
+    }
+
+    for (int i = 0; i < num_playlists; i++) {
+        catalog->playlist_order[i] = i;
+    }
+    qsort_r(catalog->playlist_order, num_playlists, sizeof(uint32_t), comparePlaylists, playlists);
+    num_playlist_songs = 0;
+    for (int i = 0; i < num_playlists; i++) {
+        uint32_t pos = catalog->playlist_order[i];
+
+        catalog->playlists[pos].name = addString(catalog, &used, playlists[pos].name);
+        catalog->playlists[pos].length = playlists[pos].name.length;
+    }
+    for (int i = 0; i < num_playlists; i++) {
+        catalog->playlists[i].first = num_playlist_songs;
+        catalog->playlists[i].num_songs = playlists[i].num_songs;
+        for (int j = 0; j < playlists[i].num_songs; j++) {
+            PlaylistSong* song = &catalog->playlist_songs[num_playlist_songs++];
+
+            song->song = searchSong(catalog, playlists[i].songs[j].data, playlists[i].songs[j].length);
+            song->name = song->song != -1 ? catalog->songs[song->song].name : addString(catalog, &used, playlists[i].songs[j]);
+        }
+    }
+
+    free(playlists);
+    unmapFile(&song_map);
+    unmapFile(&playlist_map);
+
+    // Names of playlist songs that exist were not added, so the table may be shorter
+    ((CatalogHeader*) catalog->data)->strings_size = used + 1;
+    catalog->size = header.strings_offset + used + 1;
+    catalog->data = realloc(catalog->data, catalog->size);
+    setSections(catalog);
+
+    fillSongs(catalog, folder);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Writes a catalog file, replacing the old one at once.
+ * @Parameters: catalog - The catalog.
+ *              folder - The folder of the catalog file.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void writeCatalog(Catalog* catalog, char* folder) {
+    char* file = NULL, *tmp = NULL;
+    size_t written = 0;
+    ssize_t bytes = 0;
+    int fd;
+
+    asprintf(&file, "%s/%s", folder, CATALOG_FILE);
+    asprintf(&tmp, "%s/.%s.tmp", folder, CATALOG_FILE);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        while (written < catalog->size && (bytes = write(fd, catalog->data + written, catalog->size - written)) > 0) {
+            written += bytes;
+        }
+        close(fd);
+        // A folder that can't be written just keeps the catalog in memory
+        if (written != catalog->size || rename(tmp, file) == -1) {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(file);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Maps the catalog file of a folder if it is newer than the text files.
+ * @Parameters: catalog - Where to map it.
+ *              folder - The folder.
+ * @Return: 0 if successful, -1 if the file has to be built again.
+ *
+ ********************************************************************/
+static int mapCatalog(Catalog* catalog, char* folder) {
+    struct stat st, text;
+    char* file = NULL;
+    const char* texts[] = {SONGS_FILE, PLAYLISTS_FILE};
+    int fd;
+
+    asprintf(&file, "%s/%s", folder, CATALOG_FILE);
+    fd = open(file, O_RDONLY);
+    free(file);
+    file = NULL;
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Changes in the same timestamp tick are not told apart, so a tie builds it again
+    for (int i = 0; i < 2; i++) {
+        asprintf(&file, "%s/%s", folder, texts[i]);
+        if (stat(file, &text) == -1 || text.st_mtim.tv_sec > st.st_mtim.tv_sec || (text.st_mtim.tv_sec == st.st_mtim.tv_sec && text.st_mtim.tv_nsec >= st.st_mtim.tv_nsec)) {
+            free(file);
+            close(fd);
+            return -1;
+        }
+        free(file);
+        file = NULL;
+    }
+
+    catalog->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (catalog->data == MAP_FAILED) {
+        return -1;
+    }
+    catalog->size = st.st_size;
+    catalog->mapped = 1;
+
+    if (setSections(catalog) == -1 || checkRecords(catalog) == -1) {
+        munmap(catalog->data, catalog->size);
+        return -1;
+    }
+
+    return 0;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Frees a catalog.
+ * @Parameters: catalog - The catalog.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void freeCatalog(Catalog* catalog) {
+    if (catalog->mapped) {
+        munmap(catalog->data, catalog->size);
+    }
+    else {
+        free(catalog->data);
+    }
+    for (int i = 0; i < 2; i++) {
+        free(catalog->song_frames[i]);
+        free(catalog->playlist_frames[i]);
+    }
+    free(catalog);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Builds the SONGS_RESPONSE frames of a catalog, encoded for a
+ *           frame version.
+ * @Parameters: catalog - The catalog.
+ *              version - The frame version.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void buildSongFrames(Catalog* catalog, int version) {
+    char* buffer = NULL, *num_songs_str = NULL, *wire = NULL;
+    int buffer_length = 0, remaining_space = 0, empty_length, length = 0;
+    int frame_size = version == FRAME_V2 ? FRAME_V2_MAX_DATA : FRAME_SIZE;
+
+    asprintf(&num_songs_str, "%d#", catalog->num_songs);
+    asprintf(&buffer, T2_SONGS_RESPONSE, num_songs_str);
+
+    empty_length = buffer_length = strlen(buffer);
+    remaining_space = frame_size - buffer_length - 1;
+
+    for (int i = 0; i < catalog->num_songs; i++) {
+        int song_length = catalog->songs[i].length;
+        char* song = catalog->strings + catalog->songs[i].name;
+        int separator = i != 0 ? 1 : 0;
+        
+        if (song_length + separator <= remaining_space) {
+            if (separator) {
+                buffer = realloc(buffer, buffer_length + 2);
+                buffer[buffer_length] = '&';
+                buffer_length++;
+                remaining_space -= 1;
+            }
+            buffer = realloc(buffer, buffer_length + song_length + 1);
+            memcpy(buffer + buffer_length, song, song_length);
+
+            buffer_length += song_length;               
+            remaining_space -= song_length; 
+        }
+        else if (buffer_length > empty_length) {
+            // Not enough space -> close the current frame
+            length = appendFrame(&wire, length, buffer, buffer_length, version);
+            free(buffer);
+
+            // Reset the buffer for the next iteration
+            asprintf(&buffer, T2_SONGS_RESPONSE, num_songs_str);
+            buffer_length = empty_length;
+            remaining_space = frame_size - buffer_length - 1;
+
+            // Process the song again
+            i--;
+        }
+        // A song that does not even fit in an empty frame is left out
+    }
+    length = appendFrame(&wire, length, buffer, buffer_length, version);
+    free(buffer);
+    free(num_songs_str);
+
+    catalog->song_frames[version - 1] = wire;
+    catalog->song_frames_length[version - 1] = length;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Builds the PLAYLISTS_RESPONSE frames of a catalog, encoded for a
+ *           frame version.
+ * @Parameters: catalog - The catalog.
+ *              version - The frame version.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void buildPlaylistFrames(Catalog* catalog, int version) {
+    char* buffer = NULL, *num_playlists_str = NULL, *num_songs_str = NULL, *wire = NULL;
+    int buffer_length = 0, remaining_space = 0, empty_length, length = 0;
+    int frame_size = version == FRAME_V2 ? FRAME_V2_MAX_DATA : FRAME_SIZE;
+
+    asprintf(&num_playlists_str, "%d", catalog->num_playlists);
+    asprintf(&buffer, T2_PLAYLISTS_RESPONSE, num_playlists_str);
+
+    empty_length = buffer_length = strlen(buffer);
+    remaining_space = frame_size - buffer_length - 1;
+    
+    for (int i = 0; i < catalog->num_playlists; i++) {
+        PlaylistRecord* playlist = &catalog->playlists[i];
+        int playlist_length = playlist->length;
+        int fresh = buffer_length == empty_length;
+
+        asprintf(&num_songs_str, "#%u#", playlist->num_songs);
+        if (playlist_length + (int) strlen(num_songs_str) <= remaining_space) {
+            buffer = realloc(buffer, buffer_length + strlen(num_songs_str) + playlist_length + 1);
+            strcpy(buffer + buffer_length, num_songs_str);
+            buffer_length += strlen(num_songs_str);
+            remaining_space -= strlen(num_songs_str);
+            
+            memcpy(buffer + buffer_length, catalog->strings + playlist->name, playlist_length);
+            buffer_length += playlist_length;
+            remaining_space -= playlist_length;
+
+            // Add songs to playlist
+            for (uint32_t j = 0; j < playlist->num_songs; j++) {
+                char* song = catalog->strings + catalog->playlist_songs[playlist->first + j].name;
+                int song_length = strlen(song);
+
+                if (song_length + 1 <= remaining_space) {
+                    buffer = realloc(buffer, buffer_length + song_length + 2);
+                    buffer[buffer_length] = '&';
+                    buffer_length++;
+                    remaining_space -= 1;
+
+                    memcpy(buffer + buffer_length, song, song_length);
+                    buffer_length += song_length;               
+                    remaining_space -= song_length; 
+                }
+                else if (!fresh) {
+                    // Not enough space -> close the current frame
+                    length = appendFrame(&wire, length, buffer, buffer_length, version);
+                    free(buffer);
+
+                    // Reset the buffer for the next iteration
+                    asprintf(&buffer, T2_PLAYLISTS_RESPONSE, num_playlists_str);
+                    buffer_length = empty_length;
+                    remaining_space = frame_size - buffer_length - 1;
+
+                    // Process the playlist again
+                    i -= 1;
+                    break;
+                }
+                else {
+                    // The playlist does not fit even in an empty frame
+                    break;
+                }
+            }
+        }
+        else if (!fresh) {
+            // Not enough space -> close the current frame
+            length = appendFrame(&wire, length, buffer, buffer_length, version);
+            free(buffer);
+
+            // Reset the buffer for the next iteration
+            asprintf(&buffer, T2_PLAYLISTS_RESPONSE, num_playlists_str);
+            buffer_length = empty_length;
+            remaining_space = frame_size - buffer_length - 1;
+
+            // Process the playlist again
+            i -= 1;
+        }
+        free(num_songs_str);
+        num_songs_str = NULL;
+    }
+    length = appendFrame(&wire, length, buffer, buffer_length, version);
+    free(buffer);
+    free(num_playlists_str);
+
+    catalog->playlist_frames[version - 1] = wire;
+    catalog->playlist_frames_length[version - 1] = length;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Loads the catalog of a folder, building its catalog file again
+ *           if the text files changed.
+ * @Parameters: folder - The folder.
+ * @Return: The new catalog.
+ *
+ ********************************************************************/
+static Catalog* loadCatalog(char* folder) {
+    Catalog* catalog = calloc(1, sizeof(Catalog));
+
+    if (mapCatalog(catalog, folder) == -1) {
+        buildCatalog(catalog, folder);
+        writeCatalog(catalog, folder);
+    }
+    // The list responses only change with the catalog, so they are built once
+    for (int version = FRAME_V1; version <= FRAME_V2; version++) {
+        buildSongFrames(catalog, version);
+        buildPlaylistFrames(catalog, version);
+    }
+    catalog->refs = 1;
+
+    return catalog;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Replaces the current catalog with a new one.
+ * @Parameters: catalog - The new catalog.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void swapCatalog(Catalog* catalog) {
+    Catalog* old;
+
+    pthread_mutex_lock(&catalog_mu);
+    old = current;
+    current = catalog;
+    pthread_mutex_unlock(&catalog_mu);
+
+    if (old != NULL) {
+        releaseCatalog(old);
+    }
+}
+
+/********************************************************************
+ *
+ * @Purpose: Thread waiting for changes on the catalog files to reload them.
+ * @Parameters: arg - Not used.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void* watchCatalog(void* arg) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t bytes;
+    sigset_t set;
+
+    (void) arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    // Only cancelled while waiting, never in the middle of a reload
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (1) {
+        int changed = 0;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        bytes = read(fd_notify, events, sizeof(events));
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) continue;
+            break;
+        }
+        for (char* p = events; p < events + bytes; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+            struct inotify_event* event = (struct inotify_event*) p;
+
+            if (event->len > 0 && (strcmp(event->name, SONGS_FILE) == 0 || strcmp(event->name, PLAYLISTS_FILE) == 0)) {
+                changed = 1;
+            }
+        }
+        // Every change read at once is handled with a single reload
+        if (changed) {
+            swapCatalog(loadCatalog(catalog_folder));
+            printF(C_GREEN "\nSongs and playlists reloaded\n" C_RESET);
+        }
+    }
+
+    return NULL;
+}
+
+int initCatalog(char* folder) {
+    catalog_folder = strdup(folder);
+    swapCatalog(loadCatalog(folder));
+
+    fd_notify = inotify_init1(IN_CLOEXEC);
+    if (fd_notify == -1) {
+        return -1;
+    }
+    // Editors may replace the file instead of writing it, so renames count too
+    if (inotify_add_watch(fd_notify, folder, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) == -1 || pthread_create(&watcher, NULL, watchCatalog, NULL) != 0) {
+        close(fd_notify);
+        fd_notify = -1;
+        return -1;
+    }
+    watching = 1;
+
+    return 0;
+}
+
+Catalog* getCatalog() {
+    Catalog* catalog;
+
+    pthread_mutex_lock(&catalog_mu);
+    catalog = current;
+    __atomic_add_fetch(&catalog->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&catalog_mu);
+
+    return catalog;
+}
+
+void releaseCatalog(Catalog* catalog) {
+    if (__atomic_sub_fetch(&catalog->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        freeCatalog(catalog);
+    }
+}
+
+int findSong(Catalog* catalog, char* name) {
+    return searchSong(catalog, name, strlen(name));
+}
+
+int findPlaylist(Catalog* catalog, char* name) {
+    int low = 0, high = catalog->num_playlists - 1, length = strlen(name);
+
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        PlaylistRecord* playlist = &catalog->playlists[catalog->playlist_order[middle]];
+        int result = compareName(catalog->strings + playlist->name, playlist->length, name, length);
+
+        if (result == 0) return catalog->playlist_order[middle];
+        if (result < 0) low = middle + 1;
+        else high = middle - 1;
+    }
+
+    return -1;
+}
+
+char* getSongChecksum(Catalog* catalog, char* name, struct stat* st) {
+    int pos = findSong(catalog, name);
+    SongRecord* song;
+
+    if (pos == -1) {
+        return NULL;
+    }
+    // A song replaced without touching the text files keeps its old record
+    song = &catalog->songs[pos];
+    if (song->inode != (uint64_t) st->st_ino || song->size != (uint64_t) st->st_size ||
+        song->mtime_sec != st->st_mtim.tv_sec || song->mtime_nsec != st->st_mtim.tv_nsec ||
+        strnlen(song->md5, MD5_HEX) != MD5_HEX - 1) {
+        return NULL;
+    }
+
+    return strdup(song->md5);
+}
+
+void stopCatalog() {
+    if (watching) {
+        pthread_cancel(watcher);
+        pthread_join(watcher, NULL);
+        close(fd_notify);
+        fd_notify = -1;
+        watching = 0;
+    }
+    swapCatalog(NULL);
+    free(catalog_folder);
+    catalog_folder = NULL;
+}
@@ -0,0 +1,175 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - Song Catalog
+ * @Author: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains function declarations and structs definitions used
+ *   for keeping the songs and playlists of a Poole in memory.
+ ********************************************************************/
+#ifndef _CATALOG_H_
+#define _CATALOG_H_
+
+#include "functions.h"
+#include "configs.h"
+#include "connections.h"
+#include "md5.h"
+
+#define SONGS_FILE "songs.txt"
+#define PLAYLISTS_FILE "playlists.txt"
+#define CATALOG_FILE "catalog.bin"
+#define CATALOG_MAGIC 0x4C544143
+#define CATALOG_VERSION 2
+
+/**
+ * Header of the binary catalog file. The offsets are from the start of the
+ * file. The records keep the order of the text files, and the order arrays
+ * list their positions sorted by name.
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_songs;
+    uint32_t num_playlists;
+    uint32_t num_playlist_songs;
+    uint32_t strings_size;
+    uint32_t songs_offset;
+    uint32_t playlists_offset;
+    uint32_t playlist_songs_offset;
+    uint32_t song_order_offset;
+    uint32_t playlist_order_offset;
+    uint32_t strings_offset;
+} CatalogHeader;
+
+/**
+ * Record of a song in the binary catalog file. The name is an offset in the
+ * string table, where names are '\0' terminated. The checksum only holds
+ * while the file keeps the inode, size and modification time recorded.
+*/
+typedef struct {
+    uint32_t name;
+    uint32_t length;
+    uint64_t size;
+    uint64_t inode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    char md5[MD5_HEX];
+} SongRecord;
+
+/**
+ * Record of a playlist in the binary catalog file. Its songs are the entries
+ * from first in the playlist songs array.
+*/
+typedef struct {
+    uint32_t name;
+    uint32_t length;
+    uint32_t first;
+    uint32_t num_songs;
+} PlaylistRecord;
+
+/**
+ * Song of a playlist in the binary catalog file: the position of the song in
+ * the songs array, -1 if it does not exist, and its name in the string table.
+*/
+typedef struct {
+    int32_t song;
+    uint32_t name;
+} PlaylistSong;
+
+/**
+ * Structure for storing the songs and playlists of the server folder, as the
+ * binary catalog file mapped in memory (or built in memory if it can't be
+ * written). The list responses are kept encoded for each frame version
+ * (index version - 1). A catalog is never modified once built, a new one
+ * replaces it.
+*/
+typedef struct {
+    char* data;
+    size_t size;
+    int mapped;
+    SongRecord* songs;
+    int num_songs;
+    PlaylistRecord* playlists;
+    int num_playlists;
+    PlaylistSong* playlist_songs;
+    uint32_t* song_order;
+    uint32_t* playlist_order;
+    char* strings;
+    char* song_frames[2];
+    int song_frames_length[2];
+    char* playlist_frames[2];
+    int playlist_frames_length[2];
+    int refs;
+} Catalog;
+
+/********************************************************************
+ *
+ * @Purpose: Loads the catalog of a folder and starts watching its files,
+ *           loading it again whenever they change. The binary catalog file
+ *           is generated from the text files when it is older than them.
+ * @Parameters: folder - The folder holding songs.txt and playlists.txt.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+int initCatalog(char* folder);
+
+/********************************************************************
+ *
+ * @Purpose: Gets the current catalog. It stays valid, even if it is replaced,
+ *           until it is released.
+ * @Parameters: ---
+ * @Return: The catalog.
+ *
+ ********************************************************************/
+Catalog* getCatalog();
+
+/********************************************************************
+ *
+ * @Purpose: Releases a catalog obtained with getCatalog.
+ * @Parameters: catalog - The catalog.
+ * @Return: ---
+ *
+ ********************************************************************/
+void releaseCatalog(Catalog* catalog);
+
+/********************************************************************
+ *
+ * @Purpose: Finds a song by its name, with a binary search.
+ * @Parameters: catalog - The catalog.
+ *              name - The name of the song.
+ * @Return: Position of the song in the songs array, -1 if it does not exist.
+ *
+ ********************************************************************/
+int findSong(Catalog* catalog, char* name);
+
+/********************************************************************
+ *
+ * @Purpose: Finds a playlist by its name, with a binary search.
+ * @Parameters: catalog - The catalog.
+ *              name - The name of the playlist.
+ * @Return: Position of the playlist in the playlists array, -1 if it does not exist.
+ *
+ ********************************************************************/
+int findPlaylist(Catalog* catalog, char* name);
+
+/********************************************************************
+ *
+ * @Purpose: Gets the checksum of a song from its record, if the file of the
+ *           song did not change since the catalog was built.
+ * @Parameters: catalog - The catalog.
+ *              name - The name of the song.
+ *              st - Status of the open file of the song.
+ * @Return: A copy of the checksum, NULL if the record does not hold it.
+ *
+ ********************************************************************/
+char* getSongChecksum(Catalog* catalog, char* name, struct stat* st);
+
+/********************************************************************
+ *
+ * @Purpose: Stops watching the folder and releases the current catalog.
+ * @Parameters: ---
+ * @Return: ---
+ *
+ ********************************************************************/
+void stopCatalog();
+
+#endif
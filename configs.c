@@ -12,6 +12,7 @@ Disc_conf readConfigDis(char* file) {
     Disc_conf config;
     int fd_config;
     char *buffer;
+    Reader reader;
 
     fd_config = open(file, O_RDONLY);
 
@@ -22,10 +23,19 @@ Disc_conf readConfigDis(char* file) {
         exit(-1);
     }
 
-    readLine(fd_config, &config.ip_poole);
-    readNum(fd_config, &config.port_poole);
-    readLine(fd_config, &config.ip_bow);
-    readNum(fd_config, &config.port_bow);
+    initReader(&reader, fd_config);
+    readerLine(&reader, &config.ip_poole);
+    readerNum(&reader, &config.port_poole);
+    readerLine(&reader, &config.ip_bow);
+    readerNum(&reader, &config.port_bow);
+
+    // Optional line: policy choosing the Poole of each Bowman
+    config.policy = POLICY_LEAST_LOADED;
+    readerLine(&reader, &buffer);
+    if (strcmp(buffer, "users") == 0) config.policy = POLICY_USERS;
+    else if (strcmp(buffer, "two-choices") == 0) config.policy = POLICY_TWO_CHOICES;
+    else if (strcmp(buffer, "affinity") == 0) config.policy = POLICY_AFFINITY;
+    free(buffer);
 
     close(fd_config);
 
@@ -36,6 +46,7 @@ User_conf readConfigBow(char* file) {
     User_conf config;
     int fd_config;
     char *buffer;
+    Reader reader;
 
     fd_config = open(file, O_RDONLY);
 
@@ -46,11 +57,22 @@ User_conf readConfigBow(char* file) {
         exit(-1);
     }
 
-    readLine(fd_config, &config.user);
-    readLine(fd_config, &config.files_path);
-    readLine(fd_config, &config.ip);
-    readNum(fd_config, &config.port);
-    
+    initReader(&reader, fd_config);
+    readerLine(&reader, &config.user);
+    readerLine(&reader, &config.files_path);
+    readerLine(&reader, &config.ip);
+    readerNum(&reader, &config.port);
+
+    // Optional line: number of Pooles a song is downloaded from at once
+    config.sources = DEFAULT_SOURCES;
+    readerLine(&reader, &buffer);
+    if (buffer[0] >= '0' && buffer[0] <= '9') {
+        config.sources = atoi(buffer);
+        if (config.sources <= 0) config.sources = DEFAULT_SOURCES;
+        if (config.sources > MAX_SOURCES) config.sources = MAX_SOURCES;
+    }
+    free(buffer);
+
     close(fd_config);
 
     return config;
@@ -60,6 +82,7 @@ Server_conf readConfigPol(char* file) {
     Server_conf config;
     int fd_config;
     char *buffer;
+    Reader reader;
 
     fd_config = open(file, O_RDONLY);
 
@@ -70,70 +93,183 @@ Server_conf readConfigPol(char* file) {
         exit(-1);
     }
 
-    readLine(fd_config, &config.server);
-    readLine(fd_config, &config.path);
-    readLine(fd_config, &config.discovery_ip);
-    readNum(fd_config, &config.discovery_port);
-    readLine(fd_config, &config.user_ip);
-    readNum(fd_config, &config.user_port);
+    initReader(&reader, fd_config);
+    readerLine(&reader, &config.server);
+    readerLine(&reader, &config.path);
+    readerLine(&reader, &config.discovery_ip);
+    readerNum(&reader, &config.discovery_port);
+    readerLine(&reader, &config.user_ip);
+    readerNum(&reader, &config.user_port);
+
+    // Optional line: number of transfer workers
+    config.workers = DEFAULT_WORKERS;
+    readerLine(&reader, &buffer);
+    if (buffer[0] >= '0' && buffer[0] <= '9') {
+        config.workers = atoi(buffer);
+        if (config.workers <= 0) config.workers = DEFAULT_WORKERS;
+    }
+    free(buffer);
 
     close(fd_config);
 
     return config;
 }
 
-char **readSongs(char* file, int *num_songs) {
-    char **songs;
+/********************************************************************
+ *
+ * @Purpose: Maps a whole file in memory, read only.
+ * @Parameters: file - Path to the file.
+ *              mapping - Where to store the mapping.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+static int mapFile(char* file, Mapping* mapping) {
+    struct stat st;
     int fd_config;
     char *buffer;
 
+    mapping->data = NULL;
+    mapping->size = 0;
+    mapping->views = NULL;
+
     fd_config = open(file, O_RDONLY);
 
-    if (fd_config == -1) {
+    if (fd_config == -1 || fstat(fd_config, &st) == -1) {
         asprintf(&buffer,C_RED "EROOR: %s not found.\n" C_RESET, file);
         printF(buffer);
         free(buffer);
-        exit(-1);
-    }
-    
-    readNum(fd_config, num_songs);
-    songs = (char**) malloc(sizeof(char*) * (*num_songs));
-    for (int i = 0; i < *num_songs; i++) {
-        readLine(fd_config, &songs[i]);
+        if (fd_config != -1) close(fd_config);
+        return -1;
     }
 
+    // An empty file can't be mapped, it is parsed as having no lines
+    if (st.st_size > 0) {
+        mapping->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_config, 0);
+        if (mapping->data == MAP_FAILED) {
+            mapping->data = NULL;
+            close(fd_config);
+            return -1;
+        }
+        mapping->size = st.st_size;
+    }
     close(fd_config);
 
-    return songs;
+    return 0;
 }
 
-Playlist* readPlaylists(char* file, int *num_playlists) {
-    Playlist *playlist;
-    int fd_config;
-    char *buffer;
+/********************************************************************
+ *
+ * @Purpose: Gets the next line of a mapped file, without its '\n'.
+ *           At the end of the file the line is empty.
+ * @Parameters: mapping - The mapping.
+ *              offset - Offset of the line, moved to the next one.
+ *              line - Where to store the view of the line.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void nextLine(Mapping* mapping, size_t* offset, View* line) {
+    char* end;
 
-    fd_config = open(file, O_RDONLY);
+    if (*offset >= mapping->size) {
+        line->data = "";
+        line->length = 0;
+        return;
+    }
 
-    if (fd_config == -1) {
-        asprintf(&buffer,C_RED "EROOR: %s not found.\n" C_RESET, file);
-        printF(buffer);
-        free(buffer);
-        exit(-1);
+    line->data = mapping->data + *offset;
+    end = memchr(line->data, '\n', mapping->size - *offset);
+    line->length = end != NULL ? end - line->data : (int) (mapping->size - *offset);
+    *offset += line->length + 1;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Converts a view to an integer, like atoi.
+ * @Parameters: view - The view.
+ * @Return: The integer.
+ *
+ ********************************************************************/
+static int viewNum(View view) {
+    int num = 0, i = 0, sign = 1;
+
+    if (view.length > 0 && view.data[0] == '-') {
+        sign = -1;
+        i++;
+    }
+    for (; i < view.length && view.data[i] >= '0' && view.data[i] <= '9'; i++) {
+        num = num * 10 + (view.data[i] - '0');
     }
 
-    readNum(fd_config, num_playlists);
+    return num * sign;
+}
+
+View* mapSongs(char* file, int* num_songs, Mapping* mapping) {
+    View line;
+    size_t offset = 0;
+
+    *num_songs = 0;
+    if (mapFile(file, mapping) == -1) {
+        return NULL;
+    }
+
+    nextLine(mapping, &offset, &line);
+    *num_songs = viewNum(line);
+    if (*num_songs < 0) *num_songs = 0;
+
+    // The names stay in the mapping, only their views are allocated
+    mapping->views = malloc(sizeof(View) * (*num_songs));
+    for (int i = 0; i < *num_songs; i++) {
+        nextLine(mapping, &offset, &mapping->views[i]);
+    }
+
+    return mapping->views;
+}
+
+Playlist* mapPlaylists(char* file, int* num_playlists, Mapping* mapping) {
+    Playlist* playlist;
+    View line;
+    size_t offset = 0;
+    int num_lines = 1, used = 0;
+
+    *num_playlists = 0;
+    if (mapFile(file, mapping) == -1) {
+        return NULL;
+    }
+
+    // Every song name takes a line, so the lines bound the views needed
+    for (char* end = mapping->data; end != NULL && end < mapping->data + mapping->size; num_lines++) {
+        end = memchr(end, '\n', mapping->data + mapping->size - end);
+        if (end != NULL) end++;
+    }
+    mapping->views = malloc(sizeof(View) * num_lines);
+
+    nextLine(mapping, &offset, &line);
+    *num_playlists = viewNum(line);
+    if (*num_playlists < 0) *num_playlists = 0;
     playlist = (Playlist*) malloc(sizeof(Playlist) * (*num_playlists));
 
     for (int i = 0; i < *num_playlists; i++) {
-        readNum(fd_config, &playlist[i].num_songs);
-        playlist[i].songs = (char**) malloc(sizeof(char*) * (playlist[i].num_songs));
-        readLine(fd_config, &playlist[i].name);
+        nextLine(mapping, &offset, &line);
+        playlist[i].num_songs = viewNum(line);
+        if (playlist[i].num_songs < 0) playlist[i].num_songs = 0;
+        if (playlist[i].num_songs > num_lines - used) playlist[i].num_songs = num_lines - used;
+        playlist[i].songs = mapping->views + used;
+        used += playlist[i].num_songs;
+        nextLine(mapping, &offset, &playlist[i].name);
         for (int j = 0; j < playlist[i].num_songs; j++) {
-            readLine(fd_config, &playlist[i].songs[j]);
+            nextLine(mapping, &offset, &playlist[i].songs[j]);
         }
     }
-    
-    close(fd_config);
 
     return playlist;
-}
\ No newline at end of file
+}
+
+void unmapFile(Mapping* mapping) {
+    if (mapping->data != NULL) {
+        munmap(mapping->data, mapping->size);
+    }
+    free(mapping->views);
+    mapping->data = NULL;
+    mapping->size = 0;
+    mapping->views = NULL;
+}
@@ -11,6 +11,16 @@
 
 #include "functions.h"
 
+#define DEFAULT_WORKERS 4
+#define REPLY_WORKERS 2
+#define DEFAULT_SOURCES 1
+#define MAX_SOURCES 8
+
+#define POLICY_USERS 0 //Poole with the fewest users
+#define POLICY_LEAST_LOADED 1 //Poole with the lowest reported load
+#define POLICY_TWO_CHOICES 2 //less loaded of two Pooles picked at random
+#define POLICY_AFFINITY 3 //Poole of the user in the hash ring, unless it is too full
+
 /**
  * Structure for storing server configuration data.
 */
@@ -21,6 +31,7 @@ typedef struct {
     int discovery_port;
     char* user_ip;
     int user_port;
+    int workers;
 } Server_conf;
 
 /**
@@ -31,6 +42,7 @@ typedef struct {
     char* files_path;
     char* ip;
     int port;
+    int sources;
 } User_conf;
 
 /**
@@ -41,17 +53,36 @@ typedef struct {
     int port_poole;
     char* ip_bow;
     int port_bow;
+    int policy;
 } Disc_conf;
 
+/**
+ * Structure for a string inside a mapped file. It is not '\0' terminated.
+*/
+typedef struct {
+    char* data;
+    int length;
+} View;
+
 /**
  * Structure for storing plalist data.
 */
 typedef struct {
     int num_songs;
-    char* name;
-    char** songs;
+    View name;
+    View* songs;
 } Playlist;
 
+/**
+ * Structure for a songs or playlists file mapped in memory. The views of all
+ * the names of the file are kept in a single array.
+*/
+typedef struct {
+    char* data;
+    size_t size;
+    View* views;
+} Mapping;
+
 /********************************************************************
  *
  * @Purpose: Reads the configuration from a file and initializes the Disc_conf structure.
@@ -81,22 +112,33 @@ Server_conf readConfigPol(char* file);
 
 /********************************************************************
  *
- * @Purpose: Read songs from a specified file and returns an array of strings.
+ * @Purpose: Maps a songs file in memory and indexes the names it contains.
  * @Parameters: file - Path to the file containing song names.
  *              num_songs - Pointer to store the number of songs read.
- * @Return: Array of song names.
+ *              mapping - Where to keep the mapping, released with unmapFile.
+ * @Return: Array of views of the song names, NULL if the file can't be opened.
  *
  ********************************************************************/
-char **readSongs(char* file, int *num_songs);
+View* mapSongs(char* file, int* num_songs, Mapping* mapping);
 
 /********************************************************************
  *
- * @Purpose: Read playlists from a specified file and return an array of Playlist structures.
+ * @Purpose: Maps a playlists file in memory and indexes the names it contains.
  * @Parameters: file - Path to the file containing playlist information.
  *              num_playlists - Pointer to store the number of playlists read.
- * @Return: Array of Playlist structures.
+ *              mapping - Where to keep the mapping, released with unmapFile.
+ * @Return: Array of Playlist structures, NULL if the file can't be opened.
+ *
+ ********************************************************************/
+Playlist* mapPlaylists(char* file, int* num_playlists, Mapping* mapping);
+
+/********************************************************************
+ *
+ * @Purpose: Releases a mapped file and the views of its names.
+ * @Parameters: mapping - The mapping.
+ * @Return: ---
  *
  ********************************************************************/
-Playlist* readPlaylists(char* file, int *num_playlists);
+void unmapFile(Mapping* mapping);
 
 #endif
\ No newline at end of file
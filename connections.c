@@ -10,6 +10,9 @@
 #include "connections.h"
 #include <netinet/in.h>
 
+static Connection* connections[MAX_SOCKETS];
+static pthread_mutex_t connections_mu = PTHREAD_MUTEX_INITIALIZER;
+
 struct sockaddr_in configServer(char* ip, int port) {
     struct sockaddr_in server;
 
@@ -48,66 +51,685 @@ int checkPort(int port) {
 }
 
 void sendError(int sock) {
-    char buffer[256];
-    size_t i;
+    char* buffer = NULL;
+
+    asprintf(&buffer, ERROR_FRAME);
+    buffer = sendFrame(buffer, sock, strlen(buffer));
+}
 
-    memset(&buffer, 0, 256);
-    for (i = 0; i < strlen(ERROR_FRAME); i++) {
-        buffer[i] = ERROR_FRAME[i];
+/********************************************************************
+ *
+ * @Purpose: Gets the state stored for a socket, creating it the first time.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: The connection state, NULL if the socket is out of range.
+ *
+ ********************************************************************/
+static Connection* getConnection(int sock) {
+    Connection* connection;
+
+    if (sock < 0 || sock >= MAX_SOCKETS) {
+        return NULL;
     }
-    buffer[i] = '\0';
-    write(sock, buffer, 256);
+
+    connection = __atomic_load_n(&connections[sock], __ATOMIC_ACQUIRE);
+    if (connection != NULL) {
+        return connection;
+    }
+
+    pthread_mutex_lock(&connections_mu);
+    if (connections[sock] == NULL) {
+        connection = (Connection*) malloc(sizeof(Connection));
+        connection->generation = 0;
+        connection->version = FRAME_V1;
+        connection->buffer = NULL;
+        connection->start = 0;
+        connection->end = 0;
+        connection->queued = 0;
+        connection->error = 0;
+        pthread_mutex_init(&connection->write_mu, NULL);
+        __atomic_store_n(&connections[sock], connection, __ATOMIC_RELEASE);
+    }
+    connection = connections[sock];
+    pthread_mutex_unlock(&connections_mu);
+
+    return connection;
 }
 
-Frame readFrame(int sock) {
+void setFrameVersion(int sock, int version) {
+    Connection* connection = getConnection(sock);
+
+    if (connection != NULL) {
+        connection->version = version;
+    }
+}
+
+int getFrameVersion(int sock) {
+    Connection* connection = getConnection(sock);
+
+    if (connection == NULL) {
+        return FRAME_V1;
+    }
+
+    return connection->version;
+}
+
+void lockConnection(int sock) {
+    Connection* connection = getConnection(sock);
+
+    if (connection != NULL) {
+        pthread_mutex_lock(&connection->write_mu);
+    }
+}
+
+void unlockConnection(int sock) {
+    Connection* connection = getConnection(sock);
+
+    if (connection != NULL) {
+        pthread_mutex_unlock(&connection->write_mu);
+    }
+}
+
+unsigned int getGeneration(int sock) {
+    Connection* connection = getConnection(sock);
+
+    if (connection == NULL) {
+        return 0;
+    }
+
+    return __atomic_load_n(&connection->generation, __ATOMIC_ACQUIRE);
+}
+
+int lockGeneration(int sock, unsigned int generation) {
+    Connection* connection = getConnection(sock);
+
+    if (connection == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&connection->write_mu);
+    if (connection->generation != generation) {
+        pthread_mutex_unlock(&connection->write_mu);
+        return -1;
+    }
+
+    return 0;
+}
+
+int frameSize(int sock) {
+    if (getFrameVersion(sock) == FRAME_V2) {
+        return FRAME_V2_MAX_DATA;
+    }
+
+    return FRAME_SIZE;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Writes all the given buffers to a socket, retrying on partial writes.
+ * @Parameters: sock - The socket file descriptor.
+ *              iov - The buffers to write.
+ *              count - Number of buffers.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+static int writeAll(int sock, struct iovec* iov, int count) {
+    struct msghdr msg;
+    ssize_t bytes;
+
+    while (count > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        // A peer that went away must not kill the whole process with SIGPIPE
+        bytes = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (bytes <= 0) {
+            return -1;
+        }
+
+        while (count > 0 && (size_t) bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+
+    return 0;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Builds the frame returned when nothing valid could be read.
+ * @Parameters: ---
+ * @Return: A frame with an empty type, header and data.
+ *
+ ********************************************************************/
+static Frame emptyFrame() {
     Frame frame;
-    char* buffer = (char*) malloc(256);
-    int i, j;
-    
-    read(sock, buffer, 256);
-    //printF("Received frame: ");
-    //printF(buffer);
-    //printF("\n");
-    frame.type = buffer[0];
-    frame.length[0] = buffer[1];
-    frame.length[1] = buffer[2];
+
+    frame.type = '\0';
+    frame.length[0] = '0';
+    frame.length[1] = '0';
     frame.length[2] = '\0';
-    frame.header = malloc((atoi(frame.length) + 1) * sizeof(char));
-    for (i = 0; i < atoi(frame.length); i++) {
-        frame.header[i] = buffer[i + 3];
+    frame.header = calloc(2, sizeof(char));
+    frame.data = frame.header + 1;
+    frame.data_length = 0;
+
+    return frame;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Copies bytes from the receive buffer of a connection without consuming them.
+ * @Parameters: connection - The connection to copy from.
+ *              offset - Position of the first byte, relative to the first unread byte.
+ *              dest - Where to copy the bytes.
+ *              len - Number of bytes to copy.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void peekBytes(Connection* connection, unsigned int offset, char* dest, int len) {
+    unsigned int pos = (connection->start + offset) & (RECV_BUFFER - 1);
+    int first = RECV_BUFFER - pos;
+
+    if (first > len) {
+        first = len;
     }
-    frame.header[i] = '\0';
-    frame.data = malloc(256 - i - 2);
-    for (j = 0; (j + i + 3) < 256; j++) {
-        frame.data[j] = buffer[j + i + 3];
+    memcpy(dest, connection->buffer + pos, first);
+    memcpy(dest + first, connection->buffer, len - first);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Checks whether the receive buffer of a connection starts with a whole frame.
+ * @Parameters: connection - The connection to check.
+ * @Return: The length of the frame, 0 if it is not complete yet or -1 if it is not valid.
+ *
+ ********************************************************************/
+static int bufferedFrame(Connection* connection) {
+    unsigned int available = connection->end - connection->start, data_length;
+    unsigned char prefix[FRAME_V2_PREFIX];
+    int header_length;
+
+    if (available == 0) {
+        return 0;
     }
-    frame.data[j] = '\0';
 
-    free(buffer);
-    buffer = NULL;
+    peekBytes(connection, 0, (char*) prefix, 1);
+    if (prefix[0] != FRAME_V2_MAGIC) {
+        return available >= FRAME_SIZE ? FRAME_SIZE : 0;
+    }
+
+    if (available < FRAME_V2_PREFIX) {
+        return 0;
+    }
+
+    peekBytes(connection, 0, (char*) prefix, FRAME_V2_PREFIX);
+    header_length = prefix[2];
+    memcpy(&data_length, prefix + 3, sizeof(uint32_t));
+    data_length = ntohl(data_length);
+
+    if (header_length > 99 || data_length > FRAME_V2_MAX_DATA) {
+        return -1;
+    }
+
+    if (available < FRAME_V2_PREFIX + header_length + data_length) {
+        return 0;
+    }
+
+    return FRAME_V2_PREFIX + header_length + data_length;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Receives as many bytes as are available and fit in the receive buffer of a connection.
+ * @Parameters: connection - The connection to fill.
+ *              sock - The socket file descriptor.
+ *              flags - Flags passed to recvmsg.
+ * @Return: Number of bytes received, 0 if none could be received now, -1 if the connection was closed or failed.
+ *
+ ********************************************************************/
+static int fillConnection(Connection* connection, int sock, int flags) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    unsigned int free_space = RECV_BUFFER - (connection->end - connection->start);
+    unsigned int pos = connection->end & (RECV_BUFFER - 1);
+    ssize_t bytes;
+
+    if (free_space == 0) {
+        return 0;
+    }
+
+    iov[0].iov_base = connection->buffer + pos;
+    iov[0].iov_len = RECV_BUFFER - pos < free_space ? RECV_BUFFER - pos : free_space;
+    iov[1].iov_base = connection->buffer;
+    iov[1].iov_len = free_space - iov[0].iov_len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+
+    bytes = recvmsg(sock, &msg, flags);
+    if (bytes == 0) {
+        return -1;
+    }
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+
+    connection->end += bytes;
+
+    return bytes;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Takes a whole frame out of the receive buffer of a connection.
+ * @Parameters: connection - The connection to read from.
+ *              len - Length of the frame, as returned by bufferedFrame.
+ * @Return: The parsed frame. The header and the data share one allocation.
+ *
+ ********************************************************************/
+static Frame takeFrame(Connection* connection, int len) {
+    Frame frame;
+    unsigned char prefix[FRAME_V2_PREFIX];
+    uint32_t data_length;
+    int header_length, offset;
+
+    peekBytes(connection, 0, (char*) prefix, 3);
+    if (prefix[0] == FRAME_V2_MAGIC) {
+        peekBytes(connection, 0, (char*) prefix, FRAME_V2_PREFIX);
+        connection->version = FRAME_V2;
+        frame.type = prefix[1];
+        header_length = prefix[2];
+        memcpy(&data_length, prefix + 3, sizeof(uint32_t));
+        data_length = ntohl(data_length);
+        offset = FRAME_V2_PREFIX;
+    }
+    else {
+        connection->version = FRAME_V1;
+        frame.type = prefix[0];
+        frame.length[0] = prefix[1];
+        frame.length[1] = prefix[2];
+        frame.length[2] = '\0';
+        header_length = atoi(frame.length);
+        if (header_length < 0) {
+            header_length = 0;
+        }
+        data_length = FRAME_SIZE - 3 - header_length;
+        offset = 3;
+    }
+
+    frame.length[0] = '0' + header_length / 10;
+    frame.length[1] = '0' + header_length % 10;
+    frame.length[2] = '\0';
+    frame.header = malloc(header_length + data_length + 2);
+    frame.data = frame.header + header_length + 1;
+    frame.data_length = data_length;
+
+    peekBytes(connection, offset, frame.header, header_length);
+    frame.header[header_length] = '\0';
+    peekBytes(connection, offset + header_length, frame.data, data_length);
+    frame.data[data_length] = '\0';
+
+    connection->start += len;
 
     return frame;
 }
 
-char* sendFrame(char* buffer, int sock, int len) {
-    if (len < 256) buffer = (char*) realloc(buffer, 256);
-    for (int i = len; i < 256; i++) {
-        buffer[i] = '\0';
+Frame readFrame(int sock) {
+    Connection* connection = getConnection(sock);
+    int len;
+
+    if (connection == NULL) {
+        return emptyFrame();
+    }
+    if (connection->buffer == NULL) {
+        connection->buffer = malloc(RECV_BUFFER);
     }
 
-    write(sock, buffer, 256);
+    while ((len = bufferedFrame(connection)) == 0) {
+        if (fillConnection(connection, sock, 0) == -1) {
+            return emptyFrame();
+        }
+    }
+
+    if (len == -1) {
+        return emptyFrame();
+    }
+
+    return takeFrame(connection, len);
+}
+
+int pollFrame(int sock, Frame* frame) {
+    Connection* connection = getConnection(sock);
+    int len, received;
+
+    if (connection == NULL) {
+        *frame = emptyFrame();
+        return 1;
+    }
+    if (connection->buffer == NULL) {
+        connection->buffer = malloc(RECV_BUFFER);
+    }
+
+    while ((len = bufferedFrame(connection)) == 0) {
+        received = fillConnection(connection, sock, MSG_DONTWAIT);
+        if (received == 0) {
+            return 0;
+        }
+        if (received == -1) {
+            *frame = emptyFrame();
+            return 1;
+        }
+    }
+
+    if (len == -1) {
+        *frame = emptyFrame();
+        return 1;
+    }
+
+    *frame = takeFrame(connection, len);
+
+    return 1;
+}
+
+int frameReady(int sock) {
+    Connection* connection;
+
+    if (sock < 0 || sock >= MAX_SOCKETS) {
+        return 0;
+    }
+
+    connection = __atomic_load_n(&connections[sock], __ATOMIC_ACQUIRE);
+    if (connection == NULL || connection->buffer == NULL) {
+        return 0;
+    }
+
+    return bufferedFrame(connection) != 0;
+}
+
+void closeConnection(int sock) {
+    Connection* connection;
+
+    if (sock >= 0 && sock < MAX_SOCKETS) {
+        connection = __atomic_load_n(&connections[sock], __ATOMIC_ACQUIRE);
+        if (connection != NULL) {
+            pthread_mutex_lock(&connection->write_mu);
+            free(connection->buffer);
+            connection->buffer = NULL;
+            connection->start = 0;
+            connection->end = 0;
+            connection->version = FRAME_V1;
+            for (int i = 0; i < connection->queued; i++) {
+                free(connection->queue[i]);
+                connection->queue[i] = NULL;
+            }
+            connection->queued = 0;
+            connection->error = 0;
+            __atomic_add_fetch(&connection->generation, 1, __ATOMIC_RELEASE);
+            close(sock);
+            pthread_mutex_unlock(&connection->write_mu);
+
+            return;
+        }
+    }
+
+    close(sock);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Fills the prefix of a length-prefixed frame.
+ * @Parameters: prefix - Where to store the FRAME_V2_PREFIX bytes.
+ *              buffer - The data frame in the 256-byte format (type, length, header, data).
+ *              len - The length of the data frame.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void fillPrefix(unsigned char* prefix, char* buffer, int len) {
+    int header_length = (buffer[1] - '0') * 10 + (buffer[2] - '0');
+    uint32_t data_length = htonl(len - 3 - header_length);
+
+    prefix[0] = FRAME_V2_MAGIC;
+    prefix[1] = buffer[0];
+    prefix[2] = header_length;
+    memcpy(prefix + 3, &data_length, sizeof(uint32_t));
+}
+
+char* queueFrame(char* buffer, int sock, int len) {
+    Connection* connection = getConnection(sock);
+    struct iovec iov[2];
+    unsigned char prefix[FRAME_V2_PREFIX];
+    int pos, count = 1;
+
+    if (connection != NULL && connection->queued == SEND_QUEUE) {
+        flushFrames(sock);
+    }
+
+    if (getFrameVersion(sock) == FRAME_V2) {
+        fillPrefix(prefix, buffer, len);
+    }
+    else {
+        if (len < FRAME_SIZE) buffer = (char*) realloc(buffer, FRAME_SIZE);
+        for (int i = len; i < FRAME_SIZE; i++) {
+            buffer[i] = '\0';
+        }
+        prefix[0] = '\0';
+        len = FRAME_SIZE;
+    }
     //printF("Sending frame: ");
     //printF(buffer);
     //printF("\n");
-    free(buffer);
-    buffer = NULL;
+
+    if (connection == NULL) {
+        if (prefix[0] == FRAME_V2_MAGIC) {
+            iov[0].iov_base = prefix;
+            iov[0].iov_len = FRAME_V2_PREFIX;
+            iov[1].iov_base = buffer + 3;
+            iov[1].iov_len = len - 3;
+            count = 2;
+        }
+        else {
+            iov[0].iov_base = buffer;
+            iov[0].iov_len = len;
+        }
+        writeAll(sock, iov, count);
+        free(buffer);
+
+        return NULL;
+    }
+
+    pos = connection->queued;
+    memcpy(connection->prefixes[pos], prefix, FRAME_V2_PREFIX);
+    connection->queue[pos] = buffer;
+    connection->queue_length[pos] = len;
+    connection->queued++;
+
+    return NULL;
+}
+
+int getSendError(int sock) {
+    Connection* connection = getConnection(sock);
+
+    return connection != NULL && connection->error;
+}
+
+int flushFrames(int sock) {
+    Connection* connection = getConnection(sock);
+    struct iovec iov[SEND_QUEUE * 2];
+    int count = 0, error;
+
+    if (connection == NULL || connection->queued == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < connection->queued; i++) {
+        if (connection->prefixes[i][0] == FRAME_V2_MAGIC) {
+            iov[count].iov_base = connection->prefixes[i];
+            iov[count].iov_len = FRAME_V2_PREFIX;
+            count++;
+            iov[count].iov_base = connection->queue[i] + 3;
+            iov[count].iov_len = connection->queue_length[i] - 3;
+        }
+        else {
+            iov[count].iov_base = connection->queue[i];
+            iov[count].iov_len = connection->queue_length[i];
+        }
+        count++;
+    }
+
+    error = writeAll(sock, iov, count);
+    if (error == -1) {
+        connection->error = 1;
+    }
+
+    for (int i = 0; i < connection->queued; i++) {
+        free(connection->queue[i]);
+        connection->queue[i] = NULL;
+    }
+    connection->queued = 0;
+
+    return error;
+}
+
+char* sendFrame(char* buffer, int sock, int len) {
+    buffer = queueFrame(buffer, sock, len);
+    flushFrames(sock);
 
     return buffer;
 }
 
+int appendFrame(char** wire, int wire_length, char* buffer, int len, int version) {
+    unsigned char prefix[FRAME_V2_PREFIX];
+
+    if (version == FRAME_V2) {
+        fillPrefix(prefix, buffer, len);
+        *wire = realloc(*wire, wire_length + FRAME_V2_PREFIX + len - 3);
+        memcpy(*wire + wire_length, prefix, FRAME_V2_PREFIX);
+        memcpy(*wire + wire_length + FRAME_V2_PREFIX, buffer + 3, len - 3);
+
+        return wire_length + FRAME_V2_PREFIX + len - 3;
+    }
+
+    if (len > FRAME_SIZE) len = FRAME_SIZE;
+    *wire = realloc(*wire, wire_length + FRAME_SIZE);
+    memcpy(*wire + wire_length, buffer, len);
+    memset(*wire + wire_length + len, 0, FRAME_SIZE - len);
+
+    return wire_length + FRAME_SIZE;
+}
+
+int sendBytes(int sock, char* bytes, int length) {
+    struct iovec iov;
+
+    if (flushFrames(sock) == -1) {
+        return -1;
+    }
+    iov.iov_base = bytes;
+    iov.iov_len = length;
+
+    return writeAll(sock, &iov, 1);
+}
+
+int sendFileFrame(int sock, int id, int fd_file, off_t* offset, int len) {
+    char* buffer = NULL, data[4096];
+    unsigned char prefix[FRAME_V2_PREFIX];
+    struct iovec iov[2];
+    ssize_t bytes;
+    int header_len;
+
+    // Frames still queued must go before this one
+    if (flushFrames(sock) == -1) {
+        return -1;
+    }
+
+    asprintf(&buffer, T4_DATA, id);
+    header_len = strlen(buffer);
+    fillPrefix(prefix, buffer, header_len + len);
+
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = FRAME_V2_PREFIX;
+    iov[1].iov_base = buffer + 3;
+    iov[1].iov_len = header_len - 3;
+    if (writeAll(sock, iov, 2) == -1) {
+        free(buffer);
+        return -1;
+    }
+    free(buffer);
+
+    // The kernel moves the song from the page cache to the socket
+    while (len > 0) {
+        bytes = sendfile(sock, fd_file, offset, len);
+        if (bytes <= 0) {
+            break;
+        }
+        len -= bytes;
+    }
+
+    // Files that can not be sent with sendfile are copied instead
+    while (len > 0) {
+        bytes = pread(fd_file, data, len < (int) sizeof(data) ? len : (int) sizeof(data), *offset);
+        if (bytes <= 0) {
+            break;
+        }
+        iov[0].iov_base = data;
+        iov[0].iov_len = bytes;
+        if (writeAll(sock, iov, 1) == -1) {
+            return -1;
+        }
+        *offset += bytes;
+        len -= bytes;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    // The file got shorter: the frame is completed with zeros, so the
+    // connection keeps its framing for the other transfers
+    memset(data, 0, sizeof(data));
+    while (len > 0) {
+        iov[0].iov_base = data;
+        iov[0].iov_len = len < (int) sizeof(data) ? len : (int) sizeof(data);
+        if (writeAll(sock, iov, 1) == -1) {
+            return -1;
+        }
+        len -= iov[0].iov_len;
+    }
+
+    return 1;
+}
+
+Frame negotiateFrame(char* buffer, int sock, int len) {
+    Frame frame;
+    char* copy = (char*) malloc(len);
+
+    memcpy(copy, buffer, len);
+
+    setFrameVersion(sock, FRAME_V2);
+    buffer = sendFrame(buffer, sock, len);
+    frame = readFrame(sock);
+
+    // Peers only speaking the fixed framing answer with an error frame
+    if (frame.type == '7') {
+        frame = freeFrame(frame);
+        setFrameVersion(sock, FRAME_V1);
+        copy = sendFrame(copy, sock, len);
+        frame = readFrame(sock);
+    }
+    free(copy);
+
+    return frame;
+}
+
 Frame freeFrame(Frame frame) {
     free(frame.header);
-    free(frame.data);
     frame.header = NULL;
     frame.data = NULL;
 
@@ -116,14 +738,14 @@ Frame freeFrame(Frame frame) {
 
 int getFileData(char* data, File* file) {
     int j = 0, k = 0, len = strlen(data);
-    char** data_split = malloc(sizeof(char*) * 4);
+    char** data_split = malloc(sizeof(char*) * 5);
 
-    for (int i = 0; i < 4; i++) {
+    for (int i = 0; i < 5; i++) {
         data_split[i] = NULL;
     }
 
     for (int i = 0; i < len; i++) {
-        if (data[i] == '&') {
+        if (data[i] == '&' && j < 4) {
             data_split[j] = realloc(data_split[j], sizeof(char) * (k + 1));
             data_split[j][k] = '\0';
             k = 0;
@@ -138,7 +760,8 @@ int getFileData(char* data, File* file) {
     data_split[j] = realloc(data_split[j], sizeof(char) * (k + 1));
     data_split[j][k] = '\0';
 
-    for (int i = 0; i < 4; i++) {
+    file->offset = 0;
+    for (int i = 0; i < 5; i++) {
         switch (i) {
             case 0:
                 file->file_name = malloc(sizeof(char) * (strlen(data_split[i]) + 1));
@@ -158,6 +781,13 @@ int getFileData(char* data, File* file) {
                 file->id = atoi(data_split[i]);
                 free(data_split[i]);
                 break;
+            case 4:
+                // Older Pooles send no offset
+                if (data_split[i] != NULL) {
+                    file->offset = atoi(data_split[i]);
+                    free(data_split[i]);
+                }
+                break;
         }
     }
 
@@ -170,16 +800,3 @@ int getFileData(char* data, File* file) {
 
     return 0;
 }
-
-int configQueue(key_t *key, int *id) {
-    *key = ftok("bowman.c", 12);
-    if (*key == (key_t) - 1){
-        return -1;
-    }
-
-    *id = msgget(*key, 0600 | IPC_CREAT);
-    if(*id == - 1){
-        return -1;
-    }
-    return 0;
-}
@@ -11,8 +11,31 @@
 #define _CONNECTIONS_H_
 
 #include "functions.h"
+#include "md5.h"
 
-#define CHECK_UP_TO 5 + 3
+#define MAX_SOCKETS 65536
+#define SEND_TIMEOUT 30 //seconds a user can go without reading before a send to it fails
+#define REPLY_QUEUE 64 //replies waiting for a user that is not reading before it is dropped
+#define EPOLL_EVENTS 64
+#define MAX_TRANSFERS 1000 //ids of the files sent go from 0 to MAX_TRANSFERS - 1
+
+#define FRAME_SIZE 256
+#define FRAME_V1 1
+#define FRAME_V2 2
+#define FRAME_V2_MAGIC 0xF2 //never a valid v1 type character
+#define FRAME_V2_PREFIX 7 //magic + type + header length + 4 bytes of data length
+#define FRAME_V2_MAX_DATA 65536
+#define RECV_BUFFER 131072 //power of two able to hold the biggest frame
+#define SEND_QUEUE 64 //frames written with a single writev
+
+#define LOAD_PERIOD 2 //seconds between the load reports of a Poole
+#define LOAD_USER 1 //weights of each metric in the load of a Poole
+#define LOAD_TRANSFER 2
+#define LOAD_QUEUED 4
+#define LOAD_BYTES 1048576 //bytes per second counting as one
+#define LEASE_TIME (3 * LOAD_PERIOD) //seconds a Poole stays registered without reporting
+#define RING_POINTS 64 //points of each Poole in the hash ring
+#define RING_BOUND 125 //percentage of the average users a Poole can take in the ring
 
 #define ERROR_FRAME "707UNKNOWN\n"
 #define T1_POOLE "109NEW_POOLE%s&%s&%d"
@@ -20,14 +43,20 @@
 #define T1_OK "106CON_OK"
 #define T1_OK_BOW "106CON_OK%s&%s&%d"
 #define T1_KO "106CON_KO"
+#define T1_POOLE_LIST "110POOLE_LIST"
+#define T1_POOLES_RESPONSE "115POOLES_RESPONSE%s" //name&ip&port#name&ip&port...
+#define T1_LOAD "110POOLE_LOAD%s&%s&%d&%d&%d&%d&%lu" //name&ip&port&users&transfers&queued&bytes per second
 #define T2_SONGS "210LIST_SONGS"
 #define T2_PLAYLISTS "214LIST_PLAYLISTS"
 #define T2_SONGS_RESPONSE "214SONGS_RESPONSE%s" //%s = numsongs#song1&song2&...&songN\0
 #define T2_PLAYLISTS_RESPONSE "218PLAYLISTS_RESPONSE%s" //%s = numplaylist\0
 #define T3_DOWNLOAD_SONG "313DOWNLOAD_SONG%s" //%s = songname
+#define T3_RESUME_SONG "313DOWNLOAD_SONG%s&%d&%s" //songname&offset&MD5 of the partial download
+#define T3_RANGE_SONG "313DOWNLOAD_SONG%s&0&-&%d&%d" //songname&0&-&part&parts, the part-th of parts equal ranges
 #define T3_DOWNLOAD_LIST "313DOWNLOAD_LIST%s" //%s = playlistname
-#define T4_NEW_FILE "408NEW_FILE%s&%d&%s&%d" //songname&filesize&MD5&id
+#define T4_NEW_FILE "408NEW_FILE%s&%d&%s&%d&%d" //songname&filesize&MD5&id&offset
 #define T4_DATA "409FILE_DATA%d&" //id&data
+#define T4_ABORT "410FILE_ABORT%d" //id of a song that changed while it was sent
 #define T5_OK "508CHECK_OK%d"
 #define T5_KO "508CHECK_KO%d"
 #define T6 "604EXIT%s"
@@ -43,53 +72,171 @@ typedef struct {
     char length[3];
     char* header;
     char* data;
+    int data_length;
 } Frame;
 
 /**
- * Structure for storing a server.
+ * Structure for storing the state of an open socket. The generation changes
+ * every time the socket is closed, telling apart the connections that reuse
+ * its file descriptor. The error is set once queued frames could not be sent.
+*/
+typedef struct {
+    unsigned int generation;
+    int version;
+    char* buffer;
+    unsigned int start;
+    unsigned int end;
+    char* queue[SEND_QUEUE];
+    int queue_length[SEND_QUEUE];
+    unsigned char prefixes[SEND_QUEUE][FRAME_V2_PREFIX];
+    int queued;
+    int error;
+    pthread_mutex_t write_mu;
+} Connection;
+
+/**
+ * Structure for storing a server. num_users is the count the Poole reported,
+ * pending the Bowmans sent to it since then. The Poole is dropped once its
+ * lease ends without a new report.
 */
 typedef struct {
     char* name;
     int num_users;
     char* ip;
     int port;
+    int transfers;
+    int queued;
+    unsigned long bytes_rate;
+    int pending;
+    time_t assigned;
+    time_t lease;
+    int sock;
 } Server;
 
 /**
- * Structure for storing file data.
+ * Structure for a point of the hash ring: the hash it sits at and the
+ * position of its Poole in the servers array.
+*/
+typedef struct {
+    uint32_t hash;
+    int server;
+} RingPoint;
+
+#define PART_EXTENSION ".part" //file receiving a download until it is checked
+#define META_EXTENSION ".part.meta" //MD5 of the song a partial download belongs to
+
+/**
+ * Structure for storing file data. offset is the byte the transfer started
+ * from, when it resumes a partial download.
 */
 typedef struct {
     char* file_name;
     int file_size;
     char* md5;
     int id;
+    int offset;
     int data_received;
     int fd;
+    Md5 checksum;
 } File;
 
 /**
- * Structure for storing data to be send to the threads in poole.
+ * Structure for storing a Poole a song can be downloaded from.
+*/
+typedef struct {
+    char* name;
+    struct sockaddr_in address;
+} Source;
+
+/**
+ * Structure for storing a song downloaded from several Pooles at once, each
+ * one sending a range of it to the same file.
+*/
+typedef struct {
+    File* file;
+    Source* sources;
+    int num_sources;
+} Split;
+
+/**
+ * Structure for storing a range of a split download: the Poole it comes
+ * from, the size and MD5 that Poole has for the song and whether it arrived.
+*/
+typedef struct {
+    Split* split;
+    int source;
+    int part;
+    int parts;
+    int size;
+    char md5[MD5_HEX];
+    int received;
+    int done;
+} Range;
+
+/**
+ * Structure for storing data to be send to the transfer jobs in poole.
+ * With parts over 1 only the part-th of parts equal ranges is sent.
 */
 typedef struct {
     char* name;
-    int fd_pos;
-    int thread_pos;
+    int sock;
+    int id_pos;
+    int offset;
+    char* md5;
+    int part;
+    int parts;
+    unsigned int generation;
 } Send;
 
 /**
- * Structure for storing data to be send through messsage queues.
+ * Structure for storing a reply that poole hands to a worker instead of
+ * writing it from the thread handling every user. The buffer is a frame, or
+ * the bytes of a list response held by a reference to the catalog (a
+ * Catalog*) if catalog is set. With close set, the connection is closed once
+ * the reply is sent. The replies to a socket are sent in order, next is the
+ * one after this.
+*/
+typedef struct Reply {
+    int sock;
+    unsigned int generation;
+    char* buffer;
+    int length;
+    void* catalog;
+    int close;
+    struct Reply* next;
+} Reply;
+
+/**
+ * Structure for storing the replies waiting to be sent to a socket.
 */
 typedef struct {
-    long mtype;
-    char data[244];
-} Msg;
+    Reply* first;
+    Reply* last;
+    int count;
+} ReplyQueue;
 
 /**
- * Structure the id of a song to be send and its name.
+ * Structure for storing a Bowman connected to poole.
+*/
+typedef struct User {
+    int fd;
+    char* name;
+    struct User* prev;
+    struct User* next;
+} User;
+
+/**
+ * Structure the id of a song to be send and its name. The slot belongs to the
+ * connection of sock and generation, and it is freed by the CHECK of the user,
+ * when the transfer fails or when the user disconnects.
 */
 typedef struct {
     int id;
     char* name;
+    int sock;
+    unsigned int generation;
+    int sending;
+    int checked;
 } Ids;
 /********************************************************************
  *
@@ -130,18 +277,156 @@ int checkPort(int port);
  ********************************************************************/
 void sendError(int sock);
 
+/********************************************************************
+ *
+ * @Purpose: Sets the framing used to send frames through a socket.
+ * @Parameters: sock - The socket file descriptor.
+ *              version - FRAME_V1 for fixed 256-byte frames, FRAME_V2 for length-prefixed frames.
+ * @Return: ---
+ *
+ ********************************************************************/
+void setFrameVersion(int sock, int version);
+
+/********************************************************************
+ *
+ * @Purpose: Gets the framing used to send frames through a socket.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: FRAME_V1 or FRAME_V2.
+ *
+ ********************************************************************/
+int getFrameVersion(int sock);
+
+/********************************************************************
+ *
+ * @Purpose: Locks the writing side of a socket, so frames sent by different
+ *           threads through the same socket do not get mixed.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: ---
+ *
+ ********************************************************************/
+void lockConnection(int sock);
+
+/********************************************************************
+ *
+ * @Purpose: Unlocks the writing side of a socket.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: ---
+ *
+ ********************************************************************/
+void unlockConnection(int sock);
+
+/********************************************************************
+ *
+ * @Purpose: Gets the generation of the connection a socket holds now.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: The generation.
+ *
+ ********************************************************************/
+unsigned int getGeneration(int sock);
+
+/********************************************************************
+ *
+ * @Purpose: Locks the writing side of a socket only if it still holds the
+ *           connection of a generation, so a thread outliving a connection
+ *           does not write to the one that reused its file descriptor.
+ * @Parameters: sock - The socket file descriptor.
+ *              generation - The generation got when the work started.
+ * @Return: 0 if locked, -1 if the connection was closed (and it is not locked).
+ *
+ ********************************************************************/
+int lockGeneration(int sock, unsigned int generation);
+
+/********************************************************************
+ *
+ * @Purpose: Gets the maximum length of a frame (type, length, header and data) for a socket.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: The maximum frame length.
+ *
+ ********************************************************************/
+int frameSize(int sock);
+
 /********************************************************************
  *
  * @Purpose: Reads a data frame header from a socket and parses its components.
+ *           Both the fixed 256-byte frames and the length-prefixed ones are accepted,
+ *           and the socket is set to answer with the framing it received.
+ *           Bytes are received in blocks into the buffer of the connection, so the
+ *           following frames may already be buffered (see frameReady).
  * @Parameters: sock - The socket file descriptor to read the header from.
- * @Return: The parsed header structure.
+ * @Return: The parsed header structure, with an empty type if the connection was closed.
  *
  ********************************************************************/
 Frame readFrame(int sock);
 
 /********************************************************************
  *
- * @Purpose: Sends a data frame over a socket, ensuring the frame is of a fixed size.
+ * @Purpose: Reads a frame from a socket without blocking. All the available bytes are
+ *           received, so when it returns 0 the socket has been drained, as edge-triggered
+ *           epoll requires.
+ * @Parameters: sock - The socket file descriptor to read the frame from.
+ *              frame - Where to store the frame read.
+ * @Return: 1 if a frame was stored (with an empty type if the connection was closed),
+ *          0 if no whole frame can be read without blocking.
+ *
+ ********************************************************************/
+int pollFrame(int sock, Frame* frame);
+
+/********************************************************************
+ *
+ * @Purpose: Checks whether a whole frame is already buffered for a socket, so
+ *           readFrame will not block even if select does not report the socket.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: 1 if a frame is buffered, 0 otherwise.
+ *
+ ********************************************************************/
+int frameReady(int sock);
+
+/********************************************************************
+ *
+ * @Purpose: Discards the buffered data of a socket and closes it.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: ---
+ *
+ ********************************************************************/
+void closeConnection(int sock);
+
+/********************************************************************
+ *
+ * @Purpose: Queues a data frame to be sent over a socket, without sending it yet.
+ *           The queue is written with a single writev when it gets full or when
+ *           flushFrames or sendFrame are called. Threads sharing a socket must
+ *           hold lockConnection while queueing and sending.
+ * @Parameters: buffer - The data frame to send.
+ *              sock - The socket file descriptor to send the frame to.
+ *              len - The length of the data frame.
+ * @Return: A null pointer, the buffer is freed once sent.
+ *
+ ********************************************************************/
+char* queueFrame(char* buffer, int sock, int len);
+
+/********************************************************************
+ *
+ * @Purpose: Tells whether frames queued for a socket could not be sent, also
+ *           when queueFrame sent them on its own because the queue was full.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: 1 if a send failed since the socket was opened, 0 otherwise.
+ *
+ ********************************************************************/
+int getSendError(int sock);
+
+/********************************************************************
+ *
+ * @Purpose: Sends all the frames queued for a socket.
+ * @Parameters: sock - The socket file descriptor.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+int flushFrames(int sock);
+
+/********************************************************************
+ *
+ * @Purpose: Sends a data frame over a socket right away, ensuring the frame is of a fixed size.
+ *           Frames queued before it are sent in the same writev.
  * @Parameters: buffer - The data frame to send.
  *              sock - The socket file descriptor to send the frame to.
  * @Return: A null pointer after freeing the buffer.
@@ -149,6 +434,59 @@ Frame readFrame(int sock);
  ********************************************************************/
 char* sendFrame(char* buffer, int sock, int len);
 
+/********************************************************************
+ *
+ * @Purpose: Appends a frame, encoded as it is sent, to a block of bytes that
+ *           can be sent later with sendBytes.
+ * @Parameters: wire - The block of bytes, reallocated to fit the frame.
+ *              wire_length - Number of bytes already in the block.
+ *              buffer - The frame to encode. It is not freed.
+ *              len - Length of the frame.
+ *              version - Frame version used to encode it.
+ * @Return: The new number of bytes in the block.
+ *
+ ********************************************************************/
+int appendFrame(char** wire, int wire_length, char* buffer, int len, int version);
+
+/********************************************************************
+ *
+ * @Purpose: Sends frames already encoded with appendFrame, after the frames queued.
+ * @Parameters: sock - The socket file descriptor to send the frames to.
+ *              bytes - The encoded frames.
+ *              length - Number of bytes.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+int sendBytes(int sock, char* bytes, int length);
+
+/********************************************************************
+ *
+ * @Purpose: Sends a FILE_DATA frame using the length-prefixed framing, letting the
+ *           kernel copy the data from the file to the socket.
+ * @Parameters: sock - The socket file descriptor to send the frame to.
+ *              id - The id of the file being sent.
+ *              fd_file - The file descriptor of the file being sent.
+ *              offset - Offset of the file where the data starts, updated with the bytes sent.
+ *              len - Number of bytes of the file to send.
+ * @Return: 0 if successful, -1 otherwise. If the file ends before len bytes,
+ *          the frame is completed with zeros and 1 is returned.
+ *
+ ********************************************************************/
+int sendFileFrame(int sock, int id, int fd_file, off_t* offset, int len);
+
+/********************************************************************
+ *
+ * @Purpose: Sends the first frame of a connection using the length-prefixed framing
+ *           and reads the answer. If the peer does not understand it, the frame is
+ *           sent again using the fixed 256-byte framing.
+ * @Parameters: buffer - The data frame to send.
+ *              sock - The socket file descriptor to send the frame to.
+ *              len - The length of the data frame.
+ * @Return: The frame received as answer.
+ *
+ ********************************************************************/
+Frame negotiateFrame(char* buffer, int sock, int len);
+
 /********************************************************************
  *
  * @Purpose: Frees the memory inside a Frame data structure.
@@ -160,21 +498,12 @@ Frame freeFrame(Frame frame);
 
 /********************************************************************
  *
- * @Purpose: gets the file data from a frame data.
+ * @Purpose: gets the file data from a frame data. The offset is 0 if the
+ *           frame has none.
  * @Parameters: data - String with the data to get.
  *              file - The file data structure to be filled.
  * @Return: Returns 0 if the file exists, -1 otherwise.
  *
  ********************************************************************/
 int getFileData(char* data, File* file);
-
-/********************************************************************
- *
- * @Purpose: Configure a message queue with the specified key and identifier.
- * @Parameters: key - Pointer to store the generated key using ftok.
- *              id - Pointer to store the message queue identifier.
- * @Return: 0 on success, -1 on error.
- *
- ********************************************************************/
-int configQueue(key_t* key, int* id);
 #endif
\ No newline at end of file
@@ -21,34 +21,270 @@
 #include "connections.h"
 
 Server* servers;
-int* clients_fd;
-int num_servers = 0, num_clients = 0;
+RingPoint* ring = NULL;
+int num_servers = 0, ring_size = 0, policy;
+
+/********************************************************************
+ *
+ * @Purpose: Compares two points of the hash ring, for qsort.
+ * @Parameters: a - The first point.
+ *              b - The second point.
+ * @Return: Negative, zero or positive as a goes before, with or after b.
+ *
+ ********************************************************************/
+static int comparePoints(const void* a, const void* b) {
+    uint32_t first = ((const RingPoint*) a)->hash, second = ((const RingPoint*) b)->hash;
+
+    return (first > second) - (first < second);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Builds the hash ring again from the registered Pooles. Each one
+ *           gets RING_POINTS points, so a Poole joining or leaving only moves
+ *           the users next to its own points.
+ * @Parameters: ---
+ * @Return: ---
+ *
+ ********************************************************************/
+void buildRing() {
+    char* buffer = NULL;
+    int length;
+
+    if (policy != POLICY_AFFINITY) {
+        return;
+    }
+    ring_size = num_servers * RING_POINTS;
+    ring = realloc(ring, ring_size * sizeof(RingPoint));
+    for (int i = 0; i < num_servers; i++) {
+        for (int j = 0; j < RING_POINTS; j++) {
+            length = asprintf(&buffer, "%s#%d", servers[i].name, j);
+            ring[i * RING_POINTS + j].hash = hashName(buffer, length);
+            ring[i * RING_POINTS + j].server = i;
+            free(buffer);
+            buffer = NULL;
+        }
+    }
+    qsort(ring, ring_size, sizeof(RingPoint), comparePoints);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Finds a Poole by its name.
+ * @Parameters: name - The name of the Poole.
+ * @Return: Position of the Poole in the servers array, -1 if it is not registered.
+ *
+ ********************************************************************/
+int findServer(char* name) {
+    for (int i = 0; i < num_servers; i++) {
+        if (strcmp(name, servers[i].name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Registers a Poole, or updates it if it was already registered,
+ *           giving it a new lease.
+ * @Parameters: name - The name of the Poole. It is stored or freed.
+ *              ip - The IP for its Bowmans. It is stored.
+ *              port - The port for its Bowmans.
+ * @Return: Position of the Poole in the servers array.
+ *
+ ********************************************************************/
+int addServer(char* name, char* ip, int port) {
+    int pos = findServer(name);
+
+    if (pos == -1) {
+        num_servers++;
+        servers = realloc(servers, num_servers * sizeof(Server));
+        pos = num_servers - 1;
+        servers[pos].name = name;
+    }
+    else {
+        // A Poole started again before its lease ended
+        free(name);
+        free(servers[pos].ip);
+    }
+    servers[pos].ip = ip;
+    servers[pos].port = port;
+    servers[pos].num_users = 0;
+    servers[pos].transfers = 0;
+    servers[pos].queued = 0;
+    servers[pos].bytes_rate = 0;
+    servers[pos].pending = 0;
+    servers[pos].assigned = 0;
+    servers[pos].lease = time(NULL) + LEASE_TIME;
+    servers[pos].sock = -1;
+    buildRing();
+
+    return pos;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Removes a Poole from the servers array.
+ * @Parameters: pos - Position of the Poole in the servers array.
+ * @Return: ---
+ *
+ ********************************************************************/
+void removeServer(int pos) {
+    free(servers[pos].name);
+    free(servers[pos].ip);
+    for (int j = pos; j < num_servers - 1; j++) {
+        servers[j] = servers[j + 1];
+    }
+    num_servers--;
+    servers = realloc(servers, num_servers * sizeof(Server));
+    buildRing();
+}
+
+/********************************************************************
+ *
+ * @Purpose: Removes the Pooles whose lease ended without a report, so no
+ *           Bowman is sent to them.
+ * @Parameters: ---
+ * @Return: ---
+ *
+ ********************************************************************/
+void expireServers() {
+    char* buffer = NULL;
+    time_t now = time(NULL);
+
+    for (int i = num_servers - 1; i >= 0; i--) {
+        if (servers[i].lease < now) {
+            asprintf(&buffer, "\n%sServer %s stopped reporting, removed\n%s", C_RED, servers[i].name, C_RESET);
+            printF(buffer);
+            free(buffer);
+            buffer = NULL;
+            removeServer(i);
+        }
+    }
+}
+
+/********************************************************************
+ *
+ * @Purpose: Computes the load of a Poole from its users and the metrics
+ *           it reported.
+ * @Parameters: server - The Poole.
+ * @Return: The load, weighted with the LOAD macros.
+ *
+ ********************************************************************/
+long serverLoad(Server* server) {
+    return (long) (server->num_users + server->pending) * LOAD_USER + (long) server->transfers * LOAD_TRANSFER + (long) server->queued * LOAD_QUEUED + (long) (server->bytes_rate / LOAD_BYTES);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Chooses the Poole of a user in the hash ring: the first one
+ *           after the hash of its name holding fewer users than the bound
+ *           (RING_BOUND percent of the average), so the same user keeps
+ *           going to the same Poole while it is not overloaded.
+ * @Parameters: key - The name of the user.
+ * @Return: Position of the Poole in the servers array.
+ *
+ ********************************************************************/
+int ringServer(char* key) {
+    uint32_t hash = hashName(key, strlen(key));
+    int first = 0, last = ring_size, users = 1, bound;
+
+    for (int i = 0; i < num_servers; i++) {
+        users += servers[i].num_users + servers[i].pending;
+    }
+    // Rounded up, so some Poole is always below it
+    bound = (users * RING_BOUND + num_servers * 100 - 1) / (num_servers * 100);
+
+    while (first < last) {
+        int middle = first + (last - first) / 2;
+
+        if (ring[middle].hash < hash) first = middle + 1;
+        else last = middle;
+    }
+    for (int i = 0; i < ring_size; i++) {
+        Server* server = &servers[ring[(first + i) % ring_size].server];
+
+        if (server->num_users + server->pending < bound) {
+            return ring[(first + i) % ring_size].server;
+        }
+    }
+
+    return ring[first % ring_size].server;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Chooses the Poole for a new Bowman using the configured policy.
+ * @Parameters: key - The name of the user.
+ * @Return: Position of the Poole in the servers array.
+ *
+ ********************************************************************/
+int chooseServer(char* key) {
+    int pos = 0, other;
+
+    if (policy == POLICY_AFFINITY) {
+        return ringServer(key == NULL ? "" : key);
+    }
+    if (policy == POLICY_TWO_CHOICES) {
+        if (num_servers == 1) {
+            return 0;
+        }
+        // Two different Pooles at random, the less loaded one wins
+        pos = rand() % num_servers;
+        other = rand() % (num_servers - 1);
+        if (other >= pos) other++;
+
+        return serverLoad(&servers[other]) < serverLoad(&servers[pos]) ? other : pos;
+    }
+
+    for (int i = 1; i < num_servers; i++) {
+        if (policy == POLICY_USERS ? servers[i].num_users + servers[i].pending < servers[pos].num_users + servers[pos].pending : serverLoad(&servers[i]) < serverLoad(&servers[pos])) {
+            pos = i;
+        }
+    }
+
+    return pos;
+}
 
 /********************************************************************
  *
  * @Purpose: Manages connections and interactions on the Discovery server, 
  *           including request handling, server registration, and error management.
  * @Parameters: sock - Socket descriptor for the connection.
+ *              frame - The frame received from the connection. It is freed here.
  * @Return: 0 on successful handling, -1 on disconnect or error.
  *
  ********************************************************************/
-int connectionHandler(int sock) {
-    Frame frame;
-    int least_users = INT_MAX, pos;
-    char* buffer = NULL;
+int connectionHandler(int sock, Frame frame) {
+    int pos = 0, port = 0, users = 0;
+    char* buffer = NULL, *name = NULL;
 
-    frame = readFrame(sock);
-
-    if (frame.type == '1') {
+    if (frame.type == '\0') {
+        // The report connection of a Poole only closes if it is gone
+        for (int i = 0; i < num_servers; i++) {
+            if (servers[i].sock == sock) {
+                asprintf(&buffer, "\n%sServer %s got disconnected\n%s", C_RED, servers[i].name, C_RESET);
+                printF(buffer);
+                free(buffer);
+                buffer = NULL;
+                removeServer(i);
+                break;
+            }
+        }
+        frame = freeFrame(frame);
+        return -1;
+    }
+    else if (frame.type == '1') {
         if (strcmp(frame.header, "NEW_POOLE") == 0) {
-            num_servers++;
-            servers = realloc(servers, num_servers * sizeof(Server));
-            servers[num_servers - 1].name = getString(0, '&', frame.data);
-            servers[num_servers - 1].ip = getString(1 + strlen(servers[num_servers - 1].name), '&', frame.data);
-            servers[num_servers - 1].port = atoi(getString(2 + strlen(servers[num_servers - 1].name) + strlen(servers[num_servers - 1].ip), '\0', frame.data));
-            servers[num_servers - 1].num_users = 0;
-
-            asprintf(&buffer ,"New poole server registered: %s - IP: %s - Port: %d\n", servers[num_servers - 1].name, servers[num_servers - 1].ip, servers[num_servers - 1].port);
+            name = getString(0, '&', frame.data);
+            buffer = getString(1 + strlen(name), '&', frame.data);
+            port = atoi(frame.data + 2 + strlen(name) + strlen(buffer));
+            pos = addServer(name, buffer, port);
+            buffer = NULL;
+
+            asprintf(&buffer ,"New poole server registered: %s - IP: %s - Port: %d\n", servers[pos].name, servers[pos].ip, servers[pos].port);
             printF(buffer);
             free(buffer);
             buffer = NULL;
@@ -57,33 +293,93 @@ int connectionHandler(int sock) {
             buffer = sendFrame(buffer, sock, strlen(buffer));
         }
         else if (strcmp(frame.header, "NEW_BOWMAN") == 0) {
-            least_users = INT_MAX;
-
+            expireServers();
             if (num_servers == 0) {
                 asprintf(&buffer, T1_KO);
                 buffer = sendFrame(buffer, sock, strlen(buffer));
+                frame = freeFrame(frame);
                 return -1;
             }
 
+            // The user counts as pending until a report includes it
+            pos = chooseServer(frame.data);
+            servers[pos].pending++;
+            servers[pos].assigned = time(NULL);
+            
+            asprintf(&buffer, T1_OK_BOW, servers[pos].name, servers[pos].ip, servers[pos].port);
+            buffer = sendFrame(buffer, sock, strlen(buffer));
+        }
+        else if (strcmp(frame.header, "POOLE_LIST") == 0) {
+            char* list = NULL, *entry = NULL;
+            int length = 0, entry_length, room;
+
+            // Every live Poole that fits in a frame, for downloads from several at once
+            expireServers();
+            room = frameSize(sock) - (int) strlen(T1_POOLES_RESPONSE);
+            list = calloc(1, sizeof(char));
             for (int i = 0; i < num_servers; i++) {
-                if (servers[i].num_users == 0) {
-                    pos = i;
-                    break;
-                }
-                else if (least_users > servers[i].num_users) {
-                    least_users = servers[i].num_users;
-                    pos = i;
+                entry_length = asprintf(&entry, "%s%s&%s&%d", length == 0 ? "" : "#", servers[i].name, servers[i].ip, servers[i].port);
+                if (length + entry_length < room) {
+                    list = realloc(list, length + entry_length + 1);
+                    memcpy(list + length, entry, entry_length + 1);
+                    length += entry_length;
                 }
+                free(entry);
+                entry = NULL;
             }
-            servers[pos].num_users++;
-            
-            asprintf(&buffer, T1_OK_BOW, servers[pos].name, servers[pos].ip, servers[pos].port);
+            asprintf(&buffer, T1_POOLES_RESPONSE, list);
+            free(list);
             buffer = sendFrame(buffer, sock, strlen(buffer));
         }
+        else if (strcmp(frame.header, "POOLE_LOAD") == 0) {
+            char* ip = NULL, *message = NULL;
+            int transfers, queued;
+            unsigned long bytes_rate;
+
+            // Reports are not answered and keep coming through the same connection
+            if (frame.data != NULL && strchr(frame.data, '&') != NULL && strchr(strchr(frame.data, '&') + 1, '&') != NULL) {
+                name = getString(0, '&', frame.data);
+                ip = getString(1 + strlen(name), '&', frame.data);
+                pos = findServer(name);
+                if (sscanf(frame.data + 1 + strlen(name) + strlen(ip), "&%d&%d&%d&%d&%lu", &port, &users, &transfers, &queued, &bytes_rate) == 5) {
+                    if (pos == -1) {
+                        // Dropped while it was still alive, or Discovery started again
+                        pos = addServer(name, ip, port);
+                        asprintf(&message, "New poole server registered: %s - IP: %s - Port: %d\n", servers[pos].name, servers[pos].ip, servers[pos].port);
+                        printF(message);
+                        free(message);
+                        name = NULL;
+                        ip = NULL;
+                    }
+                    else if (strcmp(servers[pos].ip, ip) != 0 || servers[pos].port != port) {
+                        // Started again somewhere else before its lease ended
+                        free(servers[pos].ip);
+                        servers[pos].ip = ip;
+                        servers[pos].port = port;
+                        ip = NULL;
+                    }
+                    servers[pos].num_users = users;
+                    servers[pos].transfers = transfers;
+                    servers[pos].queued = queued;
+                    servers[pos].bytes_rate = bytes_rate;
+                    servers[pos].lease = time(NULL) + LEASE_TIME;
+                    servers[pos].sock = sock;
+                    // Bowmans sent a whole period ago are already in the count
+                    if (time(NULL) - servers[pos].assigned >= LOAD_PERIOD) {
+                        servers[pos].pending = 0;
+                    }
+                }
+                free(name);
+                free(ip);
+            }
+            frame = freeFrame(frame);
+            return 0;
+        }
         else {
             asprintf(&buffer, T1_KO);
             buffer = sendFrame(buffer, sock, strlen(buffer));
         }
+        frame = freeFrame(frame);
         return -1;
     }
     else if (frame.type == '6' && strcmp(frame.header, "EXIT") == 0) {
@@ -95,11 +391,12 @@ int connectionHandler(int sock) {
             buffer = NULL;
 
             for (int i = 0; i < num_servers; i++) {
-                if (strcmp(frame.data, servers[i].name) == 0) {
+                if (strcmp(frame.data, servers[i].name) == 0 && servers[i].num_users > 0) {
                     servers[i].num_users--;
                     break;
                 }
             }
+            frame = freeFrame(frame);
             return -1;
     }
     else if (frame.type == '6' && strcmp(frame.header, "SHUTDOWN") == 0) {
@@ -110,16 +407,11 @@ int connectionHandler(int sock) {
         free(buffer);
         buffer = NULL;
 
-        for (int i = 0; i < num_servers; i++) {
-            if (strcmp(frame.data, servers[i].name) == 0) {
-                for (int j = i; j < num_servers - 1; j++) {
-                    servers[j] = servers[j + 1];
-                }
-                num_servers--;
-                servers = realloc(servers, num_servers * sizeof(Server));
-                break;
-            }
+        pos = findServer(frame.data);
+        if (pos != -1) {
+            removeServer(pos);
         }
+        frame = freeFrame(frame);
         return -1;
     }
     else if (frame.type == '7') {
@@ -131,30 +423,67 @@ int connectionHandler(int sock) {
         printF("Wrong frame\n");
         sendError(sock);
     }
+    frame = freeFrame(frame);
 
     return 0;
 }
 
 /********************************************************************
  *
- * @Purpose: Build the fd_set for the select system call, including Poole, Bowman,
- *           and all connected clients.
- * @Parameters: poole_sock - Socket descriptor for Poole connection.
- *              bowman_sock - Socket descriptor for Bowman connection.
- * @Return: readfds containing the set of file descriptors to be monitored.
+ * @Purpose: Accepts every pending connection on a listening socket and
+ *           registers it in the epoll instance.
+ * @Parameters: listen_sock - The listening socket.
+ *              epoll_fd - The epoll instance.
+ *              kind - Name of the kind of client, used for the messages.
+ * @Return: 0 on success, -1 on error.
  *
  ********************************************************************/
-fd_set buildSelect(int poole_sock, int bowman_sock) {
-    fd_set readfds;
-    
-    FD_ZERO(&readfds);
-    FD_SET(poole_sock, &readfds);
-    FD_SET(bowman_sock, &readfds);
-    for (int i = 0; i < num_clients; i++) {
-        FD_SET(clients_fd[i], &readfds);
+int acceptClients(int listen_sock, int epoll_fd, char* kind) {
+    struct epoll_event event;
+    char* buffer = NULL;
+    int fd;
+
+    // The listening sockets are edge triggered, so they have to be drained
+    while ((fd = accept(listen_sock, NULL, NULL)) != -1) {
+        event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            closeConnection(fd);
+            continue;
+        }
+
+        asprintf(&buffer, "\n%sNew %s connection\n%s", C_GREEN, kind, C_RESET);
+        printF(buffer);
+        free(buffer);
+        buffer = NULL;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        asprintf(&buffer, "%sError accepting %s socket connection\n%s", C_RED, kind, C_RESET);
+        printF(buffer);
+        free(buffer);
+
+        return -1;
     }
 
-    return readfds;
+    return 0;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Adds a listening socket to the epoll instance.
+ * @Parameters: listen_sock - The listening socket.
+ *              epoll_fd - The epoll instance.
+ * @Return: 0 on success, -1 on error.
+ *
+ ********************************************************************/
+int listenSocket(int listen_sock, int epoll_fd) {
+    struct epoll_event event;
+
+    fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL, 0) | O_NONBLOCK);
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = listen_sock;
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &event);
 }
 
 /********************************************************************
@@ -169,10 +498,10 @@ fd_set buildSelect(int poole_sock, int bowman_sock) {
 int main(int argc, char *argv[]) {
     char* buffer = NULL;
     Disc_conf config;
-    fd_set readfds;
+    Frame frame;
+    struct epoll_event events[EPOLL_EVENTS];
     struct sockaddr_in server_p, server_b;
-    int bowman_sock, poole_sock;
-    clients_fd = (int*) malloc(sizeof(int));
+    int bowman_sock, poole_sock, epoll_fd;
 
     if (argc != 2) {
         printF(C_RED);
@@ -183,6 +512,8 @@ int main(int argc, char *argv[]) {
 
     config = readConfigDis(argv[1]);
     printF("Reading configuration file\n");
+    policy = config.policy;
+    srand(time(NULL));
 
     if (checkPort(config.port_poole) == -1 || checkPort(config.port_bow) == -1) {
         printF(C_RED);
@@ -205,71 +536,45 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1 || listenSocket(poole_sock, epoll_fd) == -1 || listenSocket(bowman_sock, epoll_fd) == -1) {
+        printF("Error in epoll\n");
+        return -1;
+    }
+
     printF("Waiting for connections...\n");
     while (1) {
-        readfds = buildSelect(poole_sock, bowman_sock);
-
-        int ready = select(CHECK_UP_TO, &readfds, NULL, NULL, NULL);
+        // Woken up every period to drop the Pooles that stopped reporting
+        int ready = epoll_wait(epoll_fd, events, EPOLL_EVENTS, LOAD_PERIOD * 1000);
         
+        expireServers();
         if (ready == -1) {
-            printF("Error in select\n");
+            if (errno == EINTR) continue;
+            printF("Error in epoll\n");
             return -1;
         }
-        else {
-            if (FD_ISSET(poole_sock, &readfds)) {
-                clients_fd[num_clients] = accept(poole_sock, NULL, NULL);
-                if (clients_fd[num_clients] == -1) {
-                    asprintf(&buffer, "%sError accepting %s socket connection\n%s", C_RED, "poole", C_RESET);
-                    printF(buffer);
-                    free(buffer);
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
 
+            if (fd == poole_sock || fd == bowman_sock) {
+                if (acceptClients(fd, epoll_fd, fd == poole_sock ? "poole" : "bowman") == -1) {
                     return -1;
                 }
-
-                num_clients++;
-                clients_fd = realloc(clients_fd, sizeof(int) * (num_clients + 1));
-
-                asprintf(&buffer, "\n%sNew %s connection\n%s", C_GREEN, "poole", C_RESET);
-                printF(buffer);
-                free(buffer);
+                continue;
             }
-            if (FD_ISSET(bowman_sock, &readfds)) {
-                clients_fd[num_clients] = accept(bowman_sock, NULL, NULL);
-                if (clients_fd[num_clients] == -1) {
-                    asprintf(&buffer, "%sError accepting %s socket connection\n%s", C_RED, "bowman", C_RESET);
-                    printF(buffer);
-                    free(buffer);
-
-                    return -1;
-                }
-
-                num_clients++;
-                clients_fd = realloc(clients_fd, sizeof(int) * (num_clients + 1));
-
-                asprintf(&buffer, "\n%sNew %s connection\n%s", C_GREEN, "bowman", C_RESET);
-                printF(buffer);
-                free(buffer);
-            }
-            for (int i = 0; i < num_clients; i++) {
-                if (FD_ISSET(clients_fd[i], &readfds)) {
-                    if (connectionHandler(clients_fd[i]) == -1) {
-                        close(clients_fd[i]);
-                        FD_CLR(clients_fd[i], &readfds);
-                        for (int j = i; j < num_clients - 1; j++) {
-                            clients_fd[j] = clients_fd[j + 1];
-                        }
-                        num_clients--;
-                    }
+            // Reads never block, so a stalled client cannot hold the rest back
+            while (pollFrame(fd, &frame)) {
+                if (connectionHandler(fd, frame) == -1) {
+                    closeConnection(fd);
+                    break;
                 }
             }
         }
     }
 
+    close (epoll_fd);
     close (poole_sock);
     close (bowman_sock);
-    for (int i = 0; i < num_clients; i++) {
-        close(clients_fd[i]);
-    }
     
     return 0;
-}
\ No newline at end of file
+}
@@ -20,12 +20,10 @@ void readNum(int source, int* num) {
 
     buffer = (char*) malloc(sizeof(char));
 
-    read(source, &buffer[i], sizeof(char));
-
-    while (buffer[i] != '\n') {
+    // Stop at the end of the file too, a last line may have no '\n'
+    while (read(source, &buffer[i], sizeof(char)) == 1 && buffer[i] != '\n') {
         i++;
         buffer = (char*) realloc(buffer, sizeof(char) * (i + 1));
-        read(source, &buffer[i], sizeof(char));
     }
 
     buffer[i] = '\0';
@@ -42,12 +40,9 @@ void readLine(int source, char** string) {
 
     buffer = (char*) malloc(sizeof(char));
 
-    read(source, &buffer[i], sizeof(char));
-
-    while (buffer[i] != '\n') {
+    while (read(source, &buffer[i], sizeof(char)) == 1 && buffer[i] != '\n') {
         i++;
         buffer = realloc(buffer, sizeof(char) * (i + 1));
-        read(source, &buffer[i], sizeof(char));
     }
 
     buffer[i] = '\0';
@@ -81,6 +76,87 @@ char* readUntil(int fd, char end) {
     return buffer;
 }
 
+void initReader(Reader* reader, int fd) {
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Reads from a reader until the character end or the end of the file.
+ * @Parameters: reader - The reader.
+ *              end - character to stop reading.
+ *              string - Pointer where the allocated string is stored.
+ * @Return: 1 if the character end was found, 0 otherwise.
+ *
+ ********************************************************************/
+static int readerToken(Reader* reader, char end, char** string) {
+    char* buffer = NULL;
+    char* found = NULL;
+    size_t length = 0, capacity = 0, size;
+    ssize_t bytes;
+
+    while (found == NULL) {
+        if (reader->start == reader->end) {
+            bytes = read(reader->fd, reader->data, READER_BUFFER);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) break;
+            reader->start = 0;
+            reader->end = bytes;
+        }
+
+        found = memchr(reader->data + reader->start, end, reader->end - reader->start);
+        size = found != NULL ? (size_t) (found - (reader->data + reader->start)) : (size_t) (reader->end - reader->start);
+
+        // The string grows by doubling, not once per character
+        if (length + size + 1 > capacity) {
+            capacity = capacity == 0 ? 64 : capacity;
+            while (length + size + 1 > capacity) capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+        memcpy(buffer + length, reader->data + reader->start, size);
+        length += size;
+        reader->start += size;
+        if (found != NULL) reader->start++;
+    }
+
+    if (buffer == NULL) buffer = malloc(sizeof(char));
+    buffer[length] = '\0';
+    *string = buffer;
+
+    return found != NULL;
+}
+
+void readerNum(Reader* reader, int* num) {
+    char* buffer = NULL;
+
+    readerToken(reader, '\n', &buffer);
+    *num = atoi(buffer);
+
+    free(buffer);
+    buffer = NULL;
+}
+
+void readerLine(Reader* reader, char** string) {
+    readerToken(reader, '\n', string);
+}
+
+char* readerUntil(Reader* reader, char end) {
+    char* buffer = NULL;
+
+    if (readerToken(reader, end, &buffer) == 0) {
+        free(buffer);
+        return NULL;
+    }
+
+    return buffer;
+}
+
+off_t readerOffset(Reader* reader) {
+    return lseek(reader->fd, 0, SEEK_CUR) - (reader->end - reader->start);
+}
+
 void checkName(char** name) {
     int i = 0, j = 0, num = 0;
 
@@ -232,37 +308,13 @@ char* getSongName(char* string) {
     return buffer;
 }
 
-void getMd5(char* file, char** md5) {
-    int pipefd[2], len = strlen(file);
-    char path[len + 1];
-    
-    if (pipe(pipefd) < 0) {
-        return;
-    }
+uint32_t hashName(const char* name, int length) {
+    uint32_t hash = 2166136261u;
 
-    switch (fork()) {
-        case -1:
-            return;
-            break;
-        case 0:
-            
-            for (size_t i = 0; i < strlen(file); i++) {
-                path[i] = file[i];
-            }
-            path[len] = '\0';
-            free(file);
-
-            close(pipefd[0]);
-            dup2(pipefd[1], 1);
-            close(pipefd[1]);
-            execlp("md5sum", "md5sum", path, NULL);
-        break;
-        default:
-            free(file);
-            close(pipefd[1]);
-            *md5 = readUntil(pipefd[0], ' ');
-            close(pipefd[0]);
-            wait(NULL);
-        break;
+    for (int i = 0; i < length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
     }
-}
\ No newline at end of file
+
+    return hash;
+}
@@ -12,6 +12,7 @@
 
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -19,6 +20,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <errno.h>
 #include <time.h>
 #include <sys/ioctl.h>
 #include <math.h>
@@ -26,10 +28,16 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <sys/mman.h>
 #include <sys/select.h>
-#include <sys/msg.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <semaphore.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sched.h>
 
 #define printF(x) write(1, x, strlen(x))
 
@@ -39,6 +47,19 @@
 #define C_BOLDGREEN "\033[1m\033[32m"
 #define BOLD    "\033[1m"
 
+#define READER_BUFFER 65536
+
+/**
+ * Structure for reading a file by blocks instead of byte by byte.
+ * The bytes from start to end are read from the file but not consumed yet.
+*/
+typedef struct {
+    int fd;
+    int start;
+    int end;
+    char data[READER_BUFFER];
+} Reader;
+
 /********************************************************************
 *
 * @Purpose: Sends the stored songs to the client.
@@ -78,6 +99,56 @@ void readLine(int source, char** string);
  ********************************************************************/
 char* readUntil(int fd, char end);
 
+/********************************************************************
+ *
+ * @Purpose: Prepares a reader for a file descriptor, reading from its current offset.
+ * @Parameters: reader - The reader.
+ *              fd - File descriptor to read from.
+ * @Return: ---
+ *
+ ********************************************************************/
+void initReader(Reader* reader, int fd);
+
+/********************************************************************
+ *
+ * @Purpose: Reads an integer line using a reader and stores it in the specified variable.
+ * @Parameters: reader - The reader.
+ *              num - Pointer to the variable where the integer will be stored.
+ * @Return: ---
+ *
+ ********************************************************************/
+void readerNum(Reader* reader, int* num);
+
+/********************************************************************
+ *
+ * @Purpose: Reads a line using a reader and allocates memory to store the information.
+ *           At the end of the file the line is empty.
+ * @Parameters: reader - The reader.
+ *              string - Pointer to a string pointer where the line will be stored.
+ * @Return: ---
+ *
+ ********************************************************************/
+void readerLine(Reader* reader, char** string);
+
+/********************************************************************
+ *
+ * @Purpose: Reads a string using a reader until it reaches the character end.
+ * @Parameters: reader - The reader.
+ *              end - character to stop reading.
+ * @Return: The string, NULL if the file ends before the character.
+ *
+ ********************************************************************/
+char* readerUntil(Reader* reader, char end);
+
+/********************************************************************
+ *
+ * @Purpose: Gets the offset of the file up to where the reader has consumed it.
+ * @Parameters: reader - The reader.
+ * @Return: The offset.
+ *
+ ********************************************************************/
+off_t readerOffset(Reader* reader);
+
 /********************************************************************
  *
  * @Purpose: Checks and removes '&' characters from a user name.
@@ -136,11 +207,11 @@ char* getSongName(char* string);
 
 /********************************************************************
  *
- * @Purpose: Generate MD5 checksum for a given file using a child process.
- * @Parameters: file - Path to the file for which MD5 checksum is generated.
- *              md5 - Pointer to store the generated MD5 checksum.
- * @Return: ---.
+ * @Purpose: Hashes a name (FNV-1a).
+ * @Parameters: name - The name.
+ *              length - Length of the name.
+ * @Return: The hash.
  *
  ********************************************************************/
-void getMd5(char* file, char** md5);
+uint32_t hashName(const char* name, int length);
 #endif
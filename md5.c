@@ -0,0 +1,459 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - MD5 checksums
+ * @Authors: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains a streaming MD5 implementation (RFC 1321) used to
+ *   check the integrity of the files sent, computed in the calling thread.
+ *
+ * - Poole keeps the checksums of its songs in a cache persisted in its folder,
+ *   so a file is only read to compute its checksum when it changes.
+ *
+ ********************************************************************/
+#include "md5.h"
+
+static Checksum* checksums = NULL;
+static int num_checksums = 0, fd_checksums = -1;
+// Positions in checksums by the hash of their names, -1 when empty
+static int* table = NULL;
+static int table_size = 0;
+static pthread_mutex_t checksums_mu = PTHREAD_MUTEX_INITIALIZER;
+
+#define ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = ROTATE((a), (s)) + (b);
+
+/********************************************************************
+ *
+ * @Purpose: Reads a little endian word.
+ * @Parameters: p - The 4 bytes to read.
+ * @Return: The word.
+ *
+ ********************************************************************/
+static inline uint32_t load32(const unsigned char* p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Processes consecutive 64-byte blocks. The rounds are fully
+ *           unrolled so every shift and constant is an immediate.
+ * @Parameters: state - The checksum state words.
+ *              data - The blocks.
+ *              blocks - Number of blocks.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void md5Blocks(uint32_t state[4], const unsigned char* data, size_t blocks) {
+    uint32_t a, b, c, d, x[16];
+
+    while (blocks > 0) {
+        for (int i = 0; i < 16; i++) {
+            x[i] = load32(data + i * 4);
+        }
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+
+        STEP(F, a, b, c, d, x[0], 0xd76aa478, 7)
+        STEP(F, d, a, b, c, x[1], 0xe8c7b756, 12)
+        STEP(F, c, d, a, b, x[2], 0x242070db, 17)
+        STEP(F, b, c, d, a, x[3], 0xc1bdceee, 22)
+        STEP(F, a, b, c, d, x[4], 0xf57c0faf, 7)
+        STEP(F, d, a, b, c, x[5], 0x4787c62a, 12)
+        STEP(F, c, d, a, b, x[6], 0xa8304613, 17)
+        STEP(F, b, c, d, a, x[7], 0xfd469501, 22)
+        STEP(F, a, b, c, d, x[8], 0x698098d8, 7)
+        STEP(F, d, a, b, c, x[9], 0x8b44f7af, 12)
+        STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17)
+        STEP(F, b, c, d, a, x[11], 0x895cd7be, 22)
+        STEP(F, a, b, c, d, x[12], 0x6b901122, 7)
+        STEP(F, d, a, b, c, x[13], 0xfd987193, 12)
+        STEP(F, c, d, a, b, x[14], 0xa679438e, 17)
+        STEP(F, b, c, d, a, x[15], 0x49b40821, 22)
+
+        STEP(G, a, b, c, d, x[1], 0xf61e2562, 5)
+        STEP(G, d, a, b, c, x[6], 0xc040b340, 9)
+        STEP(G, c, d, a, b, x[11], 0x265e5a51, 14)
+        STEP(G, b, c, d, a, x[0], 0xe9b6c7aa, 20)
+        STEP(G, a, b, c, d, x[5], 0xd62f105d, 5)
+        STEP(G, d, a, b, c, x[10], 0x02441453, 9)
+        STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14)
+        STEP(G, b, c, d, a, x[4], 0xe7d3fbc8, 20)
+        STEP(G, a, b, c, d, x[9], 0x21e1cde6, 5)
+        STEP(G, d, a, b, c, x[14], 0xc33707d6, 9)
+        STEP(G, c, d, a, b, x[3], 0xf4d50d87, 14)
+        STEP(G, b, c, d, a, x[8], 0x455a14ed, 20)
+        STEP(G, a, b, c, d, x[13], 0xa9e3e905, 5)
+        STEP(G, d, a, b, c, x[2], 0xfcefa3f8, 9)
+        STEP(G, c, d, a, b, x[7], 0x676f02d9, 14)
+        STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20)
+
+        STEP(H, a, b, c, d, x[5], 0xfffa3942, 4)
+        STEP(H, d, a, b, c, x[8], 0x8771f681, 11)
+        STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16)
+        STEP(H, b, c, d, a, x[14], 0xfde5380c, 23)
+        STEP(H, a, b, c, d, x[1], 0xa4beea44, 4)
+        STEP(H, d, a, b, c, x[4], 0x4bdecfa9, 11)
+        STEP(H, c, d, a, b, x[7], 0xf6bb4b60, 16)
+        STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23)
+        STEP(H, a, b, c, d, x[13], 0x289b7ec6, 4)
+        STEP(H, d, a, b, c, x[0], 0xeaa127fa, 11)
+        STEP(H, c, d, a, b, x[3], 0xd4ef3085, 16)
+        STEP(H, b, c, d, a, x[6], 0x04881d05, 23)
+        STEP(H, a, b, c, d, x[9], 0xd9d4d039, 4)
+        STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11)
+        STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16)
+        STEP(H, b, c, d, a, x[2], 0xc4ac5665, 23)
+
+        STEP(I, a, b, c, d, x[0], 0xf4292244, 6)
+        STEP(I, d, a, b, c, x[7], 0x432aff97, 10)
+        STEP(I, c, d, a, b, x[14], 0xab9423a7, 15)
+        STEP(I, b, c, d, a, x[5], 0xfc93a039, 21)
+        STEP(I, a, b, c, d, x[12], 0x655b59c3, 6)
+        STEP(I, d, a, b, c, x[3], 0x8f0ccc92, 10)
+        STEP(I, c, d, a, b, x[10], 0xffeff47d, 15)
+        STEP(I, b, c, d, a, x[1], 0x85845dd1, 21)
+        STEP(I, a, b, c, d, x[8], 0x6fa87e4f, 6)
+        STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10)
+        STEP(I, c, d, a, b, x[6], 0xa3014314, 15)
+        STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21)
+        STEP(I, a, b, c, d, x[4], 0xf7537e82, 6)
+        STEP(I, d, a, b, c, x[11], 0xbd3af235, 10)
+        STEP(I, c, d, a, b, x[2], 0x2ad7d2bb, 15)
+        STEP(I, b, c, d, a, x[9], 0xeb86d391, 21)
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+
+        data += MD5_BLOCK;
+        blocks--;
+    }
+}
+
+void md5Init(Md5* ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void md5Update(Md5* ctx, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    size_t blocks;
+
+    ctx->length += length;
+
+    if (ctx->used > 0) {
+        size_t fill = MD5_BLOCK - ctx->used;
+
+        if (length < fill) {
+            memcpy(ctx->block + ctx->used, bytes, length);
+            ctx->used += length;
+            return;
+        }
+        memcpy(ctx->block + ctx->used, bytes, fill);
+        md5Blocks(ctx->state, ctx->block, 1);
+        bytes += fill;
+        length -= fill;
+        ctx->used = 0;
+    }
+
+    // Whole blocks are hashed straight from the caller's buffer
+    blocks = length / MD5_BLOCK;
+    if (blocks > 0) {
+        md5Blocks(ctx->state, bytes, blocks);
+        bytes += blocks * MD5_BLOCK;
+        length -= blocks * MD5_BLOCK;
+    }
+
+    memcpy(ctx->block, bytes, length);
+    ctx->used = length;
+}
+
+void md5Final(Md5* ctx, char hex[MD5_HEX]) {
+    static const char digits[] = "0123456789abcdef";
+    uint64_t bits = ctx->length * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > MD5_BLOCK - 8) {
+        memset(ctx->block + ctx->used, 0, MD5_BLOCK - ctx->used);
+        md5Blocks(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, MD5_BLOCK - 8 - ctx->used);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[MD5_BLOCK - 8 + i] = (unsigned char) (bits >> (8 * i));
+    }
+    md5Blocks(ctx->state, ctx->block, 1);
+
+    for (int i = 0; i < 16; i++) {
+        unsigned char byte = (unsigned char) (ctx->state[i / 4] >> (8 * (i % 4)));
+
+        hex[i * 2] = digits[byte >> 4];
+        hex[i * 2 + 1] = digits[byte & 0x0f];
+    }
+    hex[MD5_HEX - 1] = '\0';
+}
+
+int md5Fd(int fd, char hex[MD5_HEX]) {
+    Md5 ctx;
+    ssize_t bytes;
+    off_t offset = 0;
+    char* data = malloc(MD5_READ);
+
+    if (data == NULL) {
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    md5Init(&ctx);
+    while ((bytes = pread(fd, data, MD5_READ, offset)) > 0) {
+        md5Update(&ctx, data, bytes);
+        offset += bytes;
+    }
+    free(data);
+    if (bytes == -1) {
+        return -1;
+    }
+    md5Final(&ctx, hex);
+
+    return 0;
+}
+
+void getMd5(char* file, char** md5) {
+    int fd = open(file, O_RDONLY);
+
+    free(file);
+    *md5 = NULL;
+    if (fd == -1) {
+        return;
+    }
+
+    *md5 = malloc(MD5_HEX);
+    if (md5Fd(fd, *md5) == -1) {
+        free(*md5);
+        *md5 = NULL;
+    }
+    close(fd);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Finds the cached checksum of a file. checksums_mu must be held.
+ * @Parameters: name - The name of the file.
+ * @Return: Position in the cache, -1 if it is not cached.
+ *
+ ********************************************************************/
+static int findChecksum(char* name) {
+    uint32_t pos;
+
+    if (table_size == 0) {
+        return -1;
+    }
+
+    // Linear probing, the table is never more than half full
+    pos = hashName(name, strlen(name)) & (table_size - 1);
+    while (table[pos] != -1) {
+        if (strcmp(checksums[table[pos]].name, name) == 0) {
+            return table[pos];
+        }
+        pos = (pos + 1) & (table_size - 1);
+    }
+
+    return -1;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Adds the checksum of a file that is not cached yet, doubling the
+ *           hash table when it gets half full. checksums_mu must be held.
+ * @Parameters: checksum - The entry, its name is kept by the cache.
+ * @Return: Position in the cache.
+ *
+ ********************************************************************/
+static int addChecksum(Checksum* checksum) {
+    uint32_t pos;
+
+    if ((num_checksums + 1) * 2 > table_size) {
+        table_size = table_size == 0 ? CHECKSUMS_TABLE : table_size * 2;
+        table = realloc(table, sizeof(int) * table_size);
+        memset(table, -1, sizeof(int) * table_size);
+        for (int i = 0; i < num_checksums; i++) {
+            pos = hashName(checksums[i].name, strlen(checksums[i].name)) & (table_size - 1);
+            while (table[pos] != -1) pos = (pos + 1) & (table_size - 1);
+            table[pos] = i;
+        }
+    }
+
+    checksums = realloc(checksums, sizeof(Checksum) * (num_checksums + 1));
+    checksums[num_checksums] = *checksum;
+    pos = hashName(checksum->name, strlen(checksum->name)) & (table_size - 1);
+    while (table[pos] != -1) pos = (pos + 1) & (table_size - 1);
+    table[pos] = num_checksums;
+
+    return num_checksums++;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Writes a cache entry as a line of the cache file.
+ * @Parameters: fd - The cache file.
+ *              checksum - The entry.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void writeChecksum(int fd, Checksum* checksum) {
+    char* buffer = NULL;
+    int length;
+
+    length = asprintf(&buffer, "%s %lu %lld %lld %ld %s\n", checksum->md5, (unsigned long) checksum->inode, (long long) checksum->size, (long long) checksum->mtime.tv_sec, checksum->mtime.tv_nsec, checksum->name);
+    if (length > 0) {
+        write(fd, buffer, length);
+    }
+    free(buffer);
+}
+
+void loadChecksums(char* folder) {
+    char* path = NULL, *content, *line, *next, *tmp = NULL;
+    struct stat st;
+    int fd, stale = 0;
+    ssize_t bytes;
+    off_t total;
+
+    asprintf(&path, "%s/%s", folder, CHECKSUMS_FILE);
+    fd = open(path, O_RDONLY);
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        content = malloc(st.st_size + 1);
+        // A read can return less than asked, keep reading until the end
+        for (total = 0; total < st.st_size; total += bytes) {
+            bytes = read(fd, content + total, st.st_size - total);
+            if (bytes <= 0) break;
+        }
+        content[total] = '\0';
+
+        // One entry per line, a later line replaces an earlier one of the same file
+        for (line = content; line != NULL && *line != '\0'; line = next) {
+            Checksum checksum;
+            unsigned long inode;
+            long long size, sec;
+            int name_at = 0;
+
+            next = strchr(line, '\n');
+            if (next != NULL) *next++ = '\0';
+
+            if (sscanf(line, "%32s %lu %lld %lld %ld %n", checksum.md5, &inode, &size, &sec, &checksum.mtime.tv_nsec, &name_at) != 5 || name_at == 0 || line[name_at] == '\0') {
+                stale++;
+                continue;
+            }
+            checksum.inode = (ino_t) inode;
+            checksum.size = (off_t) size;
+            checksum.mtime.tv_sec = (time_t) sec;
+
+            int pos = findChecksum(line + name_at);
+            if (pos == -1) {
+                checksum.name = strdup(line + name_at);
+                addChecksum(&checksum);
+            }
+            else {
+                checksum.name = checksums[pos].name;
+                checksums[pos] = checksum;
+                stale++;
+            }
+        }
+        free(content);
+    }
+    if (fd != -1) close(fd);
+
+    // Rewrite the file without the outdated entries
+    if (stale > 0) {
+        asprintf(&tmp, "%s.tmp", path);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd != -1) {
+            for (int i = 0; i < num_checksums; i++) {
+                writeChecksum(fd, &checksums[i]);
+            }
+            close(fd);
+            rename(tmp, path);
+        }
+        free(tmp);
+    }
+
+    fd_checksums = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    free(path);
+}
+
+char* getChecksum(char* name, int fd) {
+    struct stat st;
+    Checksum checksum;
+    char* md5;
+    int pos;
+
+    if (fstat(fd, &st) == -1) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&checksums_mu);
+    pos = findChecksum(name);
+    if (pos != -1 && checksums[pos].inode == st.st_ino && checksums[pos].size == st.st_size && checksums[pos].mtime.tv_sec == st.st_mtim.tv_sec && checksums[pos].mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        md5 = strdup(checksums[pos].md5);
+        pthread_mutex_unlock(&checksums_mu);
+        return md5;
+    }
+    pthread_mutex_unlock(&checksums_mu);
+
+    // Computed without the lock, other files can be served from the cache meanwhile
+    if (md5Fd(fd, checksum.md5) == -1) {
+        return NULL;
+    }
+    checksum.inode = st.st_ino;
+    checksum.size = st.st_size;
+    checksum.mtime = st.st_mtim;
+
+    pthread_mutex_lock(&checksums_mu);
+    pos = findChecksum(name);
+    if (pos == -1) {
+        checksum.name = strdup(name);
+        addChecksum(&checksum);
+    }
+    else {
+        checksum.name = checksums[pos].name;
+        checksums[pos] = checksum;
+    }
+    if (fd_checksums != -1) {
+        writeChecksum(fd_checksums, &checksum);
+    }
+    pthread_mutex_unlock(&checksums_mu);
+
+    return strdup(checksum.md5);
+}
+
+void freeChecksums() {
+    pthread_mutex_lock(&checksums_mu);
+    for (int i = 0; i < num_checksums; i++) {
+        free(checksums[i].name);
+    }
+    free(checksums);
+    checksums = NULL;
+    num_checksums = 0;
+    free(table);
+    table = NULL;
+    table_size = 0;
+    if (fd_checksums != -1) {
+        close(fd_checksums);
+        fd_checksums = -1;
+    }
+    pthread_mutex_unlock(&checksums_mu);
+}
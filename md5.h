@@ -0,0 +1,123 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - MD5 checksums
+ * @Author: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains function declarations and structs definitions used
+ *   for computing MD5 checksums (RFC 1321) without external programs.
+ ********************************************************************/
+#ifndef _MD5_H_
+#define _MD5_H_
+
+#include "functions.h"
+
+#define MD5_BLOCK 64
+#define MD5_HEX 33
+#define MD5_READ 65536
+#define CHECKSUMS_FILE "checksums.txt"
+#define CHECKSUMS_TABLE 64
+
+/**
+ * Structure for storing the state of a checksum being computed.
+*/
+typedef struct {
+    uint32_t state[4];
+    uint64_t length;
+    unsigned char block[MD5_BLOCK];
+    int used;
+} Md5;
+
+/**
+ * Structure for storing the cached checksum of a file and the state of the
+ * file it was computed from.
+*/
+typedef struct {
+    char* name;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    char md5[MD5_HEX];
+} Checksum;
+
+/********************************************************************
+ *
+ * @Purpose: Starts a new checksum.
+ * @Parameters: ctx - The checksum state.
+ * @Return: ---
+ *
+ ********************************************************************/
+void md5Init(Md5* ctx);
+
+/********************************************************************
+ *
+ * @Purpose: Adds data to a checksum. It can be called any number of times.
+ * @Parameters: ctx - The checksum state.
+ *              data - The data to add.
+ *              length - Number of bytes of data.
+ * @Return: ---
+ *
+ ********************************************************************/
+void md5Update(Md5* ctx, const void* data, size_t length);
+
+/********************************************************************
+ *
+ * @Purpose: Finishes a checksum and writes it as a hexadecimal string.
+ * @Parameters: ctx - The checksum state.
+ *              hex - Where to write the 32 digits and the '\0'.
+ * @Return: ---
+ *
+ ********************************************************************/
+void md5Final(Md5* ctx, char hex[MD5_HEX]);
+
+/********************************************************************
+ *
+ * @Purpose: Generate MD5 checksum for a given file.
+ * @Parameters: file - Path to the file for which MD5 checksum is generated. It is freed.
+ *              md5 - Pointer to store the generated MD5 checksum, NULL on error.
+ * @Return: ---.
+ *
+ ********************************************************************/
+void getMd5(char* file, char** md5);
+
+/********************************************************************
+ *
+ * @Purpose: Generate MD5 checksum of the whole content of an open file.
+ *           The file offset is not modified.
+ * @Parameters: fd - The file descriptor.
+ *              hex - Where to write the checksum.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+int md5Fd(int fd, char hex[MD5_HEX]);
+
+/********************************************************************
+ *
+ * @Purpose: Loads the checksums cached in a folder. Outdated entries are
+ *           dropped from the file.
+ * @Parameters: folder - The folder holding the files and the cache.
+ * @Return: ---
+ *
+ ********************************************************************/
+void loadChecksums(char* folder);
+
+/********************************************************************
+ *
+ * @Purpose: Gets the checksum of a file of the cache folder. It is computed
+ *           and added to the cache if the file is not cached or it changed.
+ * @Parameters: name - The name of the file in the folder.
+ *              fd - The file opened.
+ * @Return: The checksum, NULL on error.
+ *
+ ********************************************************************/
+char* getChecksum(char* name, int fd);
+
+/********************************************************************
+ *
+ * @Purpose: Frees the cached checksums.
+ * @Parameters: ---
+ * @Return: ---
+ *
+ ********************************************************************/
+void freeChecksums();
+
+#endif
@@ -0,0 +1,121 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - Thread Pool
+ * @Authors: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains the functions to run jobs on a fixed number of
+ *   worker threads fed by a queue.
+ *
+ ********************************************************************/
+#include "pool.h"
+
+/********************************************************************
+ *
+ * @Purpose: Worker thread. Runs queued jobs until the pool is stopped
+ *           and its queue is empty.
+ * @Parameters: arg - The pool the worker belongs to.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void* worker(void* arg) {
+    Pool* pool = (Pool*) arg;
+    Job* job;
+    sigset_t set;
+
+    // Signals are handled by the main thread
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->first == NULL && pool->stop == 0) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if (pool->first == NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        job = pool->first;
+        pool->first = job->next;
+        if (pool->first == NULL) pool->last = NULL;
+        pool->queued--;
+        pool->running++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        job->function(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->running--;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+int initPool(Pool* pool, int num_workers) {
+    pool->workers = malloc(sizeof(pthread_t) * num_workers);
+    pool->num_workers = 0;
+    pool->first = NULL;
+    pool->last = NULL;
+    pool->queued = 0;
+    pool->running = 0;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->workers[i], NULL, worker, pool) != 0) {
+            destroyPool(pool);
+            return -1;
+        }
+        pool->num_workers++;
+    }
+
+    return 0;
+}
+
+int addJob(Pool* pool, void* (*function)(void*), void* arg) {
+    Job* job = malloc(sizeof(Job));
+
+    if (job == NULL) {
+        return -1;
+    }
+    job->function = function;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->last == NULL) pool->first = job;
+    else pool->last->next = job;
+    pool->last = job;
+    pool->queued++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
+
+void getPoolLoad(Pool* pool, int* running, int* queued) {
+    pthread_mutex_lock(&pool->mutex);
+    *running = pool->running;
+    *queued = pool->queued;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void destroyPool(Pool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->num_workers = 0;
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+}
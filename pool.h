@@ -0,0 +1,80 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - Thread Pool
+ * @Author: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains function declarations and structs definitions used
+ *   for running jobs on a fixed number of worker threads.
+ ********************************************************************/
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include "functions.h"
+
+/**
+ * Structure for storing a job waiting to be run by the pool.
+*/
+typedef struct Job {
+    void* (*function)(void*);
+    void* arg;
+    struct Job* next;
+} Job;
+
+/**
+ * Structure for storing the workers and the queue of jobs of a pool.
+*/
+typedef struct {
+    pthread_t* workers;
+    int num_workers;
+    Job* first;
+    Job* last;
+    int queued;
+    int running;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} Pool;
+
+/********************************************************************
+ *
+ * @Purpose: Initializes a pool and starts its workers.
+ * @Parameters: pool - The pool to initialize.
+ *              num_workers - Number of worker threads.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+int initPool(Pool* pool, int num_workers);
+
+/********************************************************************
+ *
+ * @Purpose: Queues a job to be run by the first free worker.
+ * @Parameters: pool - The pool running the job.
+ *              function - The function to run.
+ *              arg - The argument passed to the function.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+int addJob(Pool* pool, void* (*function)(void*), void* arg);
+
+/********************************************************************
+ *
+ * @Purpose: Gets how busy a pool is.
+ * @Parameters: pool - The pool.
+ *              running - Where to store the number of jobs being run.
+ *              queued - Where to store the number of jobs waiting for a worker.
+ * @Return: ---
+ *
+ ********************************************************************/
+void getPoolLoad(Pool* pool, int* running, int* queued);
+
+/********************************************************************
+ *
+ * @Purpose: Waits until every queued job has been run, stops the workers
+ *           and frees the pool.
+ * @Parameters: pool - The pool to destroy.
+ * @Return: ---
+ *
+ ********************************************************************/
+void destroyPool(Pool* pool);
+
+#endif
@@ -16,230 +16,304 @@
 #include "functions.h"
 #include "configs.h"
 #include "connections.h"
-#include "semaphore_v2.h"
+#include "md5.h"
+#include "stats.h"
+#include "pool.h"
+#include "catalog.h"
 
 int bow_sock = 0, poole2mono[2];
 Server_conf config;
-int* users_fd;
-int num_users = 0, num_threads = 0;
-char** users;
-pthread_t* threads = NULL;
+User* users = NULL;
+int num_users = 0, num_ids = 0;
+Pool pool, replies;
 Ids* ids;
-pthread_mutex_t terminal = PTHREAD_MUTEX_INITIALIZER, globals = PTHREAD_MUTEX_INITIALIZER, socket_mu = PTHREAD_MUTEX_INITIALIZER;
+Stats* stats = NULL;
+StatBatch batch;
+uint64_t bytes_served = 0;
+pthread_t reporter;
+int reporting = 0, load_sock = -1;
+pthread_mutex_t terminal = PTHREAD_MUTEX_INITIALIZER, globals = PTHREAD_MUTEX_INITIALIZER;
+// Replies waiting to be sent to each socket, a job is sending them while not empty
+ReplyQueue pending[MAX_SOCKETS];
+pthread_mutex_t replies_mu = PTHREAD_MUTEX_INITIALIZER;
+
+/********************************************************************
+ *
+ * @Purpose: Frees a slot of the ids array. globals must be held.
+ * @Parameters: pos - The slot.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void freeId(int pos) {
+    free(ids[pos].name);
+    ids[pos].name = NULL;
+    ids[pos].id = -1;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Frees the ids of the songs sent to a connection that has been
+ *           closed, as they will never be checked. The songs still being sent
+ *           free theirs when their jobs see the connection closed.
+ * @Parameters: sock - The socket file descriptor of the connection.
+ *              generation - The generation of the connection.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void releaseIds(int sock, unsigned int generation) {
+    pthread_mutex_lock(&globals);
+    for (int i = 0; i < num_ids; i++) {
+        if (ids[i].name != NULL && ids[i].sock == sock && ids[i].generation == generation && !ids[i].sending) {
+            freeId(i);
+        }
+    }
+    pthread_mutex_unlock(&globals);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Sends a reply to a user, if its connection is still open. A
+ *           user that stopped reading gets its connection shut down, so the
+ *           reactor removes it.
+ * @Parameters: reply - The reply.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void sendReply(Reply* reply) {
+    int error;
+
+    if (lockGeneration(reply->sock, reply->generation) == 0) {
+        if (reply->catalog != NULL) {
+            error = sendBytes(reply->sock, reply->buffer, reply->length);
+        }
+        else {
+            reply->buffer = queueFrame(reply->buffer, reply->sock, reply->length);
+            error = flushFrames(reply->sock);
+        }
+        if (error == -1) {
+            shutdown(reply->sock, SHUT_RDWR);
+        }
+        unlockConnection(reply->sock);
+        if (reply->close) {
+            closeConnection(reply->sock);
+            releaseIds(reply->sock, reply->generation);
+        }
+    }
+
+    if (reply->catalog != NULL) {
+        releaseCatalog((Catalog*) reply->catalog);
+    }
+    else {
+        free(reply->buffer);
+    }
+}
+
+/********************************************************************
+ *
+ * @Purpose: Job sending the replies queued for a socket, one after the
+ *           other. A user that does not read only stalls the worker sending
+ *           to it, not the thread handling the requests of every user.
+ * @Parameters: arg - The socket file descriptor.
+ * @Return: ---.
+ *
+ ********************************************************************/
+void* sendReplies(void* arg) {
+    int sock = (int) (intptr_t) arg;
+    Reply* reply;
+
+    pthread_mutex_lock(&replies_mu);
+    reply = pending[sock].first;
+    pthread_mutex_unlock(&replies_mu);
+
+    while (reply != NULL) {
+        Reply* next;
+
+        sendReply(reply);
+        // The queue belongs to this job until it is left empty
+        pthread_mutex_lock(&replies_mu);
+        next = reply->next;
+        pending[sock].first = next;
+        if (next == NULL) pending[sock].last = NULL;
+        pending[sock].count--;
+        pthread_mutex_unlock(&replies_mu);
+        free(reply);
+        reply = next;
+    }
+
+    return NULL;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Hands a reply to a user to the reply workers, after the ones
+ *           already queued for the same socket.
+ * @Parameters: sock - The socket file descriptor of the user.
+ *              buffer - The frame, or the bytes of a list response.
+ *              length - Length of the buffer.
+ *              catalog - The catalog holding the bytes, NULL for a frame.
+ *                        Its reference is released once sent.
+ *              closing - 1 to close the connection once the reply is sent.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void queueReply(int sock, char* buffer, int length, Catalog* catalog, int closing) {
+    Reply* reply = malloc(sizeof(Reply));
+
+    reply->sock = sock;
+    reply->generation = getGeneration(sock);
+    reply->buffer = buffer;
+    reply->length = length;
+    reply->catalog = catalog;
+    reply->close = closing;
+    reply->next = NULL;
+
+    pthread_mutex_lock(&replies_mu);
+    if (pending[sock].first == NULL) {
+        pending[sock].first = reply;
+        addJob(&replies, sendReplies, (void*) (intptr_t) sock);
+    }
+    else {
+        pending[sock].last->next = reply;
+    }
+    pending[sock].last = reply;
+    // A user asking for more than it reads is shut down, the reactor then removes it
+    if (++pending[sock].count > REPLY_QUEUE) {
+        shutdown(sock, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&replies_mu);
+}
 
 /********************************************************************
 *
 * @Purpose: Sends the stored songs to the client.
-* @Parameters: user_pos - integer containg the index of the list of user containing the client.
+* @Parameters: user - The user requesting the list.
 * @Return: ---.
 *
 *******************************************************************/
-void listSongs(int user_pos) {
+void listSongs(User* user) {
     char* buffer = NULL;
-    int buffer_length = 0, remaining_space = 0;
+    int version = getFrameVersion(user->fd);
 
-    asprintf(&buffer, "\n%sNew request - %s requires the list of songs.\n%sSending song list to %s\n", C_GREEN, users[user_pos], C_RESET, users[user_pos]);
+    asprintf(&buffer, "\n%sNew request - %s requires the list of songs.\n%sSending song list to %s\n", C_GREEN, user->name, C_RESET, user->name);
     print(buffer, &terminal);
     free(buffer);
     buffer = NULL;
 
-    // Get number of songs and songs
-    int num_songs = 0;
-    char* file = NULL;
-    asprintf(&file, "%s/songs.txt", config.path);
-    char** songs = readSongs(file, &num_songs);
-    free(file);
-    file = NULL;
-
-    char* num_songs_str = NULL;
-
-    asprintf(&num_songs_str, "%d#", num_songs);
-    asprintf(&buffer, T2_SONGS_RESPONSE, num_songs_str);
-    free(num_songs_str);
-    num_songs_str = NULL;
-
-    buffer_length = strlen(buffer);
-    remaining_space = 256 - buffer_length - 1;
-
-    for (int i = 0; i < num_songs; i++) {
-        int song_length = strlen(songs[i]);
-        
-        if (song_length <= remaining_space) {
-            if (i != 0) {
-                buffer = realloc(buffer, buffer_length + 2);
-                //buffer[buffer_length + 1] = '\0';
-                buffer[buffer_length] = '&';
-                buffer_length++;
-                remaining_space -= 1;
-            }
-            buffer = realloc(buffer, buffer_length + song_length + 1);
-            buffer[buffer_length + song_length] = '\0';
-            strcpy(buffer + buffer_length, songs[i]);
-
-            buffer_length += song_length;               
-            remaining_space -= song_length; 
-        } else {
-            // Not enough space -> send the current buffer
-            pthread_mutex_lock(&socket_mu);
-            buffer = sendFrame(buffer, users_fd[user_pos], strlen(buffer));
-            pthread_mutex_unlock(&socket_mu);
-
-            // Reset the buffer for the next iteration
-            asprintf(&num_songs_str, "%d#", num_songs);
-            asprintf(&buffer, T2_SONGS_RESPONSE, num_songs_str);
-            free(num_songs_str);
-            num_songs_str = NULL;
-            buffer_length = strlen(buffer);
-            remaining_space = 256 - buffer_length - 1;
-
-            // Process the song again
-            i--;
-        }
-    }
-    // Enough space -> send the current buffer
-    pthread_mutex_lock(&socket_mu);
-    buffer = sendFrame(buffer, users_fd[user_pos], strlen(buffer));
-    pthread_mutex_unlock(&socket_mu);
-    buffer_length = 0;
-    remaining_space = 0;
-    for (int i = 0; i < num_songs; i++) {
-        free(songs[i]);
-        songs[i] = NULL;
-    }
-    free(songs); 
+    // The frames are already built in the catalog
+    Catalog* catalog = getCatalog();
+    queueReply(user->fd, catalog->song_frames[version - 1], catalog->song_frames_length[version - 1], catalog, 0);
 }
 
 /********************************************************************
 *
 * @Purpose: Sends the stored playlist to the client.
-* @Parameters: user_pos - integer containg the index of the list of user containing the client.
+* @Parameters: user - The user requesting the list.
 * @Return: ---.
 *
 *******************************************************************/
-void listPlaylists(int user_pos) {
+void listPlaylists(User* user) {
     char* buffer = NULL;
-    int buffer_length = 0, remaining_space = 0;
+    int version = getFrameVersion(user->fd);
 
-    asprintf(&buffer, "\n%sNew request - %s requires the list of playlists.\n%sSending playlist list to %s\n", C_GREEN, users[user_pos], C_RESET, users[user_pos]);
+    asprintf(&buffer, "\n%sNew request - %s requires the list of playlists.\n%sSending playlist list to %s\n", C_GREEN, user->name, C_RESET, user->name);
     print(buffer, &terminal);
     free(buffer);
     buffer = NULL;
 
-    // Get number of playlists and songs
-    int num_playlists = 0;
-    char* file;
-    asprintf(&file, "%s/playlists.txt", config.path); 
-    Playlist* playlists = readPlaylists(file, &num_playlists);
-    free(file);
-    file = NULL;
+    // The frames are already built in the catalog
+    Catalog* catalog = getCatalog();
+    queueReply(user->fd, catalog->playlist_frames[version - 1], catalog->playlist_frames_length[version - 1], catalog, 0);
+}
 
-    char* num_playlists_str = NULL;
-    char* num_songs_str = NULL;
+/********************************************************************
+ *
+ * @Purpose: Gives a free transfer id to a slot of the ids array, starting
+ *           the search at a random id.
+ * @Parameters: index - The slot.
+ * @Return: The id, -1 if every id is in use.
+ *
+ ********************************************************************/
+static int takeId(int index) {
+    char used[MAX_TRANSFERS] = {0};
+    int first = rand() % MAX_TRANSFERS, id = -1;
 
-    asprintf(&num_playlists_str, "%d", num_playlists);
-    asprintf(&buffer, T2_PLAYLISTS_RESPONSE, num_playlists_str);
-    free(num_playlists_str);
-    num_playlists_str = NULL;
+    pthread_mutex_lock(&globals);
+    for (int i = 0; i < num_ids; i++) {
+        if (i != index && ids[i].id >= 0 && ids[i].id < MAX_TRANSFERS) {
+            used[ids[i].id] = 1;
+        }
+    }
+    for (int i = 0; i < MAX_TRANSFERS && id == -1; i++) {
+        if (!used[(first + i) % MAX_TRANSFERS]) {
+            id = (first + i) % MAX_TRANSFERS;
+        }
+    }
+    ids[index].id = id;
+    pthread_mutex_unlock(&globals);
 
-    buffer_length = strlen(buffer);
-    remaining_space = 256 - buffer_length - 1;
-    
-    for (int i = 0; i < num_playlists; i++) {
-        int playlist_length = strlen(playlists[i].name);
-        if (playlist_length <= remaining_space) {
-            
-            asprintf(&num_songs_str, "#%d#", playlists[i].num_songs);
-            buffer = realloc(buffer, buffer_length + playlist_length + strlen(num_songs_str) + 1);
-            buffer[buffer_length + playlist_length] = '\0';
-            strcat(buffer + buffer_length, num_songs_str);
+    return id;
+}
 
-            buffer_length += strlen(num_songs_str);
-            remaining_space -= strlen(num_songs_str);
+/********************************************************************
+ *
+ * @Purpose: Frees a transfer job. Its slot of the ids array is released as
+ *           well if the user will not check the transfer, or already did.
+ * @Parameters: send - The transfer.
+ *              failed - 1 if the song did not get to the user.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void endSend(Send* send, int failed) {
+    pthread_mutex_lock(&globals);
+    ids[send->id_pos].sending = 0;
+    if (failed || ids[send->id_pos].checked || getGeneration(send->sock) != send->generation) {
+        freeId(send->id_pos);
+    }
+    pthread_mutex_unlock(&globals);
+    free(send->md5);
+    free(send->name);
+    free(send);
+}
 
-            free(num_songs_str);
-            
-            buffer = realloc(buffer, buffer_length + playlist_length + 1);
-            buffer[buffer_length + playlist_length] = '\0';
-            strcpy(buffer + buffer_length, playlists[i].name);
-
-            buffer_length += playlist_length;
-            remaining_space -= playlist_length;
-
-            // Add songs to playlist
-            for (int j = 0; j < playlists[i].num_songs; j++) {
-                int song_length = strlen(playlists[i].songs[j]);
-                if (song_length <= remaining_space) {
-                    
-                    buffer = realloc(buffer, buffer_length + 2);
-                    buffer[buffer_length + 1] = '\0';
-                    buffer[buffer_length] = '&';
-                    buffer_length++;
-                    remaining_space -= 1;
-
-                    buffer = realloc(buffer, buffer_length + song_length + 1);
-                    buffer[buffer_length + song_length] = '\0';
-                    strcpy(buffer + buffer_length, playlists[i].songs[j]);
-
-                    buffer_length += song_length;               
-                    remaining_space -= song_length; 
-                } else {
-                    // Not enough space -> send the current buffer
-                    print("\n\n3\n", &terminal);
-                    pthread_mutex_lock(&socket_mu);
-                    buffer = sendFrame(buffer, users_fd[user_pos], strlen(buffer));
-                    pthread_mutex_unlock(&socket_mu);
-
-                    // Reset the buffer for the next iteration
-                    asprintf(&num_playlists_str, "%d", num_playlists);
-                    asprintf(&buffer, T2_PLAYLISTS_RESPONSE, num_playlists_str);
-                    free(num_playlists_str);
-                    num_playlists_str = NULL;
-
-                    buffer_length = strlen(buffer);
-                    remaining_space = 256 - buffer_length - 1;
-
-                    // Process the playlist again
-                    i -= 1;
-                    // Process the song again
-                    j = 0;
-                    break;
-                }
-            }
-        } else {
-            // Not enough space -> send the current buffer
-            pthread_mutex_lock(&socket_mu);
-            buffer = sendFrame(buffer, users_fd[user_pos], strlen(buffer));
-            pthread_mutex_unlock(&socket_mu);
-
-            // Reset the buffer for the next iteration
-            asprintf(&num_playlists_str, "%d", num_playlists);
-            asprintf(&buffer, T2_PLAYLISTS_RESPONSE, num_playlists_str);
-            free(num_playlists_str);
-            num_playlists_str = NULL;
-
-            buffer_length = strlen(buffer);
-            remaining_space = 256 - buffer_length - 1;
-
-            // Process the playlist again
-            i -= 1;
-        }   
-    }
-    pthread_mutex_lock(&socket_mu);
-    buffer = sendFrame(buffer, users_fd[user_pos], strlen(buffer));
-    pthread_mutex_unlock(&socket_mu);
-    for (int i = 0; i < num_playlists; i++) {
-        free(playlists[i].name);
-        for (int j = 0; j < playlists[i].num_songs; j++) {
-            free(playlists[i].songs[j]);
-        }
-        free(playlists[i].songs);
+/********************************************************************
+ *
+ * @Purpose: Tells a user that a song can't be sent, with an id -1 NEW_FILE.
+ * @Parameters: send - The transfer.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void refuseFile(Send* send) {
+    char* buffer = NULL;
+
+    asprintf(&buffer, T4_NEW_FILE, "-", 0, "-", -1, 0);
+    if (lockGeneration(send->sock, send->generation) == 0) {
+        buffer = sendFrame(buffer, send->sock, strlen(buffer));
+        unlockConnection(send->sock);
     }
-    free(playlists);
+    free(buffer);
 }
 
 /********************************************************************
  *
- * @Purpose: Thread to handle the sending of a file to a Bowman user.
+ * @Purpose: Tells a user to discard a song that got shorter while it was
+ *           sent, instead of checking the zeros it was completed with. The
+ *           connection must be locked.
+ * @Parameters: sock - The connection of the user.
+ *              id - The id of the song.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void abortFile(int sock, int id) {
+    char* buffer = NULL;
+
+    print(C_RED "ERROR: A song got shorter while it was sent.\n" C_RESET, &terminal);
+    asprintf(&buffer, T4_ABORT, id);
+    buffer = queueFrame(buffer, sock, strlen(buffer));
+}
+
+/********************************************************************
+ *
+ * @Purpose: Job to handle the sending of a file to a Bowman user.
  *           This function calculates the MD5 checksum, assigns a unique ID,
  *           and sends the file data in frames along with relevant information.
  * @Parameters: arg - A pointer to a `Send` struct containing information about the file transfer.
@@ -248,104 +322,163 @@ void listPlaylists(int user_pos) {
  ********************************************************************/
 void* sendFile(void* arg) {
     Send* send = (Send*) arg;
-    int fd_file, size = 0, sent = 0;
+    int fd_file, size = 0, sent = 0, start = 0, end, failed = 0;
     char* buffer = NULL, *file = NULL, *md5 = NULL;
-    int index = send->thread_pos;
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGINT);
-    pthread_sigmask(SIG_BLOCK, &set, NULL);
-
-    asprintf(&file, "%s/%s", config.path, send->name);
-
-    // md5sum
-    pthread_mutex_lock(&terminal);
-    getMd5(file, &md5);
-    pthread_mutex_unlock(&terminal);
-    if (md5 == NULL) {
-        asprintf(&buffer, C_RED "Error getting md5sum.\n" C_RESET);
-        print(buffer, &terminal);
-        free(buffer);
-        asprintf(&buffer, T4_NEW_FILE, "-", 0, "-", -1);
-        pthread_mutex_lock(&socket_mu);
-        buffer = sendFrame(buffer, users_fd[send->fd_pos], strlen(buffer));
-        pthread_mutex_unlock(&socket_mu);
+    Catalog* catalog;
+    struct stat st;
+    int id;
+
+    id = takeId(send->id_pos);
+    if (id == -1) {
+        print(C_RED "ERROR: Too many transfers at once.\n" C_RESET, &terminal);
+        refuseFile(send);
+        endSend(send, 1);
         return NULL;
     }
-    file = NULL;
-    asprintf(&file, "%s/%s", config.path, send->name);
-
-    // get random(id)
-    pthread_mutex_lock(&globals);
-    srand(getpid());
-    do {
-        ids[index].id = rand() % (999 + 1);
-        for (int i = 0; i < num_threads; i++) {
-            if (i == index) {
-                continue;
-            }
-            if (ids[index].id == ids[i].id) {
-                ids[index].id = -1;
-                break;
-            }
-        }
-    } while (ids[index].id == -1);
-    ids[index].name = malloc(strlen(send->name) + 1);
-    strcpy(ids[index].name, send->name);
-    pthread_mutex_unlock(&globals);
 
     // get size and read file
+    asprintf(&file, "%s/%s", config.path, send->name);
     fd_file = open(file, O_RDONLY);
     if (fd_file == -1) {
         asprintf(&buffer, C_RED "ERROR: %s not found.\n" C_RESET, file);
         print(buffer, &terminal);
         free(buffer);
-        buffer = NULL;
-        asprintf(&buffer, T4_NEW_FILE, "-", 0, "-", -1);
-        pthread_mutex_lock(&socket_mu);
-        buffer = sendFrame(buffer, users_fd[send->fd_pos], strlen(buffer));
-        pthread_mutex_unlock(&socket_mu);
+        free(file);
+        refuseFile(send);
+        endSend(send, 1);
         return NULL;
     }
 
-    size = (int) lseek(fd_file, 0, SEEK_END);
-    lseek(fd_file, 0, SEEK_SET);
+    // md5sum, from the catalog record or the cache, only computed when the file changed
+    if (fstat(fd_file, &st) == 0) {
+        catalog = getCatalog();
+        md5 = getSongChecksum(catalog, send->name, &st);
+        releaseCatalog(catalog);
+    }
+    if (md5 == NULL) {
+        md5 = getChecksum(send->name, fd_file);
+    }
+    if (md5 == NULL) {
+        print(C_RED "Error getting md5sum.\n" C_RESET, &terminal);
+        free(file);
+        close(fd_file);
+        refuseFile(send);
+        endSend(send, 1);
+        return NULL;
+    }
 
-    // send frame
-    asprintf(&buffer, T4_NEW_FILE, send->name, size, md5, ids[index].id);
-    pthread_mutex_lock(&socket_mu);
-    buffer = sendFrame(buffer, users_fd[send->fd_pos], strlen(buffer));
-    pthread_mutex_unlock(&socket_mu);
+    size = (int) lseek(fd_file, 0, SEEK_END);
+    end = size;
+    // A partial download only goes on if the song has not changed since
+    if (send->md5 != NULL && strcmp(send->md5, md5) == 0 && send->offset > 0 && send->offset < size) {
+        start = send->offset;
+    }
+    // The range is computed from the size, the same for every Poole with this MD5
+    if (send->parts > 1) {
+        start = (int) ((long long) size * send->part / send->parts);
+        end = (int) ((long long) size * (send->part + 1) / send->parts);
+    }
+    lseek(fd_file, start, SEEK_SET);
+    sent = start;
+
+    // send frame, it goes out together with the first data frames
+    // The user may log out while the song is sent, and its socket be reused
+    asprintf(&buffer, T4_NEW_FILE, send->name, size, md5, id, start);
+    if (lockGeneration(send->sock, send->generation) == 0) {
+        buffer = queueFrame(buffer, send->sock, strlen(buffer));
+        unlockConnection(send->sock);
+    }
+    else {
+        failed = 1;
+    }
+    free(buffer);
+    buffer = NULL;
 
-    asprintf(&buffer, "%d", ids[index].id);
-    int space = 256 - 3 - 9 - strlen(buffer) - 1;
+    asprintf(&buffer, "%d", id);
+    int frame_size = frameSize(send->sock);
+    int space = frame_size - 3 - 9 - strlen(buffer) - 1;
     int occupied = 3 + 9 + strlen(buffer) + 1;
     free(buffer);
     buffer = NULL;
-    char* data = malloc(space);
+    char* data = NULL;
 
     //send file
-    while (sent < size) {
-        if (size - sent < space) {
-            space = size - sent;
+    if (getFrameVersion(send->sock) == FRAME_V2) {
+        off_t offset = start;
+
+        while (sent < end && !failed) {
+            if (end - sent < space) {
+                space = end - sent;
+            }
+            if (lockGeneration(send->sock, send->generation) == -1) {
+                failed = 1;
+                break;
+            }
+            int error = sendFileFrame(send->sock, id, fd_file, &offset, space);
+            if (error == 1) {
+                abortFile(send->sock, id);
+            }
+            unlockConnection(send->sock);
+            if (error != 0) {
+                failed = 1;
+                break;
+            }
+            sent += space;
+            __atomic_add_fetch(&bytes_served, space, __ATOMIC_RELAXED);
         }
-        read(fd_file, data, space);
-        asprintf(&buffer, T4_DATA, ids[index].id);
-        buffer = realloc(buffer, 256);
-        memcpy(buffer + strlen(buffer), data, space);
-        pthread_mutex_lock(&socket_mu);
-        buffer = sendFrame(buffer, users_fd[send->fd_pos], space + occupied);
-        pthread_mutex_unlock(&socket_mu);
-        sent += space;
-        free(buffer);
-        buffer = NULL;
+    }
+    else {
+        ssize_t bytes = 0;
+        int got;
+
+        data = malloc(space);
+
+        while (sent < end && !failed) {
+            if (end - sent < space) {
+                space = end - sent;
+            }
+            // A short read would send old bytes of the buffer as the song
+            for (got = 0; got < space && (bytes = read(fd_file, data + got, space - got)) > 0; got += bytes);
+            if (got < space) {
+                if (lockGeneration(send->sock, send->generation) == 0) {
+                    abortFile(send->sock, id);
+                    unlockConnection(send->sock);
+                }
+                failed = 1;
+                break;
+            }
+            asprintf(&buffer, T4_DATA, id);
+            buffer = realloc(buffer, frame_size);
+            memcpy(buffer + strlen(buffer), data, space);
+            if (lockGeneration(send->sock, send->generation) == -1) {
+                free(buffer);
+                buffer = NULL;
+                failed = 1;
+                break;
+            }
+            // A full queue is sent while queueing, and that send may fail
+            buffer = queueFrame(buffer, send->sock, space + occupied);
+            failed = getSendError(send->sock);
+            unlockConnection(send->sock);
+            sent += space;
+            __atomic_add_fetch(&bytes_served, space, __ATOMIC_RELAXED);
+        }
+    }
+    if (lockGeneration(send->sock, send->generation) == 0) {
+        if (flushFrames(send->sock) == -1) {
+            failed = 1;
+        }
+        unlockConnection(send->sock);
+    }
+    else {
+        failed = 1;
     }
 
     free(data);
     free(file);
     free(md5);
-    free(send->name);
-    free(send);
+    // A transfer that did not get through is never checked
+    endSend(send, failed);
     close (fd_file);
     
     return NULL;
@@ -353,83 +486,136 @@ void* sendFile(void* arg) {
 
 /********************************************************************
  *
- * @Purpose: Handle the download of a single song for a user.
- *           It checks if the requested song exists and initiates
- *           a separate thread to send the file.
- * @Parameters: song - The name of the song or list requested for download.
- *              user_pos - Position in the array of users. Identifies the requesting user.
- *              isList - An indicator (0 or 1) specifying whether the request is for a list.
+ * @Purpose: Tells a user that the song or playlist requested does not exist.
+ * @Parameters: message - The message shown on the terminal.
+ *              user - The user requesting the download.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void notFound(char* message, User* user) {
+    char* buffer = NULL;
+
+    print(message, &terminal);
+    asprintf(&buffer, T4_NEW_FILE, "-", 0, "-", -1, 0);
+    queueReply(user->fd, buffer, strlen(buffer), NULL, 0);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Queues the job sending a song of the catalog to a user.
+ * @Parameters: catalog - The catalog the song is in.
+ *              pos - Position of the song in the catalog.
+ *              offset - Bytes the user already has from a partial download.
+ *              md5 - MD5 of the song in the partial download, NULL if none.
+ *              part - Range of the song to send, out of parts.
+ *              parts - Number of ranges the song is split in, 1 for all of it.
+ *              user - The user requesting the download.
  * @Return: ---.
  *
  ********************************************************************/
-void downloadSong(char* song, int user_pos, int isList) {
-    char* buffer, *file = NULL;
-    int num_songs = 0, found = 0;
+static void sendSong(Catalog* catalog, int pos, int offset, char* md5, int part, int parts, User* user) {
+    char* buffer = NULL, *song = catalog->strings + catalog->songs[pos].name;
     Send* send = malloc(sizeof(Send));
 
-    if (isList == 0) {
-        asprintf(&buffer, "\n%sNew request - %s wants to download %s.\n%s", C_GREEN, users[user_pos], song, C_RESET);
-        print(buffer, &terminal);
-        free(buffer);
-        buffer = NULL;
-    }
-    
-    asprintf(&file, "%s/songs.txt", config.path);
-    int fd_file = open(file, O_RDONLY);
+    send->name = strdup(song);
+    send->sock = user->fd;
+    send->generation = getGeneration(user->fd);
+    send->offset = offset;
+    send->md5 = md5 == NULL ? NULL : strdup(md5);
+    send->part = part;
+    send->parts = parts;
 
-    if (fd_file == -1) {
-        asprintf(&buffer,C_RED "ERROR: %s not found.\n" C_RESET, file);
-        print(buffer, &terminal);
-        free(buffer);
-        buffer = NULL;
-        asprintf(&buffer, T4_NEW_FILE, "-", 0, "-", -1);
-        pthread_mutex_lock(&socket_mu);
-        buffer = sendFrame(buffer, users_fd[user_pos], strlen(buffer));
-        pthread_mutex_unlock(&socket_mu);
-        return;
+    asprintf(&buffer, "Sending %s to %s\n", send->name, user->name);
+    print(buffer, &terminal);
+    free(buffer);
+    buffer = NULL;
+
+    // Slots of checked transfers are reused, so only ongoing transfers take space
+    pthread_mutex_lock(&globals);
+    send->id_pos = -1;
+    for (int i = 0; i < num_ids && send->id_pos == -1; i++) {
+        if (ids[i].name == NULL) {
+            send->id_pos = i;
+        }
     }
-    
-    readNum(fd_file, &num_songs);
-    for (int i = 0; i < num_songs; i++) {
-        readLine(fd_file, &buffer);
-        if (strcmp(buffer, song) == 0) {
-            found = 1;
-            send->name = buffer;
-            send->fd_pos = user_pos;
-            buffer = NULL;
-            break;
+    if (send->id_pos == -1) {
+        ids = realloc(ids, sizeof(Ids) * (num_ids + 1));
+        send->id_pos = num_ids;
+        num_ids++;
+    }
+    ids[send->id_pos].id = -1;
+    ids[send->id_pos].name = strdup(send->name);
+    ids[send->id_pos].sock = send->sock;
+    ids[send->id_pos].generation = send->generation;
+    ids[send->id_pos].sending = 1;
+    ids[send->id_pos].checked = 0;
+    pthread_mutex_unlock(&globals);
+    addJob(&pool, sendFile, send);
+    // The monolith gets the downloads in batches, a split song counts once.
+    // A replaced song gets its record updated when the catalog is reloaded
+    if (stats != NULL && part == 0) {
+        addRecord(&batch, poole2mono[1], findSlot(stats, song, strlen(song)), catalog->songs[pos].size);
+    }
+}
+
+/********************************************************************
+ *
+ * @Purpose: Handle the download of a single song for a user.
+ *           It checks if the requested song exists and queues
+ *           the job sending the file to the transfer workers.
+ * @Parameters: song - The name of the song requested for download,
+ *                     followed by "&offset&md5" to resume a partial one,
+ *                     and by "&part&parts" to get a range of it.
+ *              user - The user requesting the download.
+ * @Return: ---.
+ *
+ ********************************************************************/
+void downloadSong(char* song, User* user) {
+    char* buffer = NULL, *md5 = NULL, *resume, *range = NULL;
+    Catalog* catalog;
+    int pos, offset = 0, part = 0, parts = 1;
+
+    resume = strchr(song, '&');
+    if (resume != NULL) {
+        *resume = '\0';
+        offset = atoi(resume + 1);
+        md5 = strchr(resume + 1, '&');
+        if (md5 != NULL) {
+            md5++;
+            range = strchr(md5, '&');
+        }
+        if (range != NULL) {
+            *range = '\0';
+            sscanf(range + 1, "%d&%d", &part, &parts);
+            if (parts < 1 || part < 0 || part >= parts) {
+                part = 0;
+                parts = 1;
+            }
         }
-        free(buffer);
-        buffer = NULL;
     }
-    close(fd_file);
-    if (found == 0) {
-        asprintf(&buffer, "Song not found\n");
-        print(buffer, &terminal);
-        free(buffer);
-        buffer = NULL;
-        asprintf(&buffer, T4_NEW_FILE, "-", 0, "-", -1);
-        pthread_mutex_lock(&socket_mu);
-        buffer = sendFrame(buffer, users_fd[user_pos], strlen(buffer));
-        pthread_mutex_unlock(&socket_mu);
-        return;
+
+    if (parts > 1) {
+        asprintf(&buffer, "\n%sNew request - %s wants part %d of %d of %s.\n%s", C_GREEN, user->name, part + 1, parts, song, C_RESET);
+    }
+    else if (offset > 0) {
+        asprintf(&buffer, "\n%sNew request - %s wants to resume %s from byte %d.\n%s", C_GREEN, user->name, song, offset, C_RESET);
+    }
+    else {
+        asprintf(&buffer, "\n%sNew request - %s wants to download %s.\n%s", C_GREEN, user->name, song, C_RESET);
     }
-    asprintf(&buffer, "Sending %s to %s\n", song, users[user_pos]);
     print(buffer, &terminal);
     free(buffer);
     buffer = NULL;
 
-    free(file);
-    file = NULL;
-    pthread_mutex_lock(&globals);
-    ids = realloc(ids, sizeof(Ids) * (num_threads + 1));
-    ids[num_threads].id = -1;
-    send->thread_pos = num_threads;
-    num_threads++;
-    threads = realloc(threads, sizeof(pthread_t) * (num_threads));
-    pthread_mutex_unlock(&globals);
-    pthread_create(&threads[send->thread_pos], NULL, sendFile, send);
-    write(poole2mono[1], send->name, strlen(send->name) + 1);
+    catalog = getCatalog();
+    pos = findSong(catalog, song);
+    if (pos == -1) {
+        notFound("Song not found\n", user);
+    }
+    else {
+        sendSong(catalog, pos, offset, md5, part, parts, user);
+    }
+    releaseCatalog(catalog);
 }
 
 /********************************************************************
@@ -438,102 +624,76 @@ void downloadSong(char* song, int user_pos, int isList) {
  *           It checks if the requested playlist exists and initiates
  *           the download of each song in the playlist.
  * @Parameters: list - The name of the playlist requested for download.
- *              user_pos - Position in the array of users. Identifies the requesting user.
+ *              user - The user requesting the download.
  * @Return: ---.
  *
  ********************************************************************/
-void downloadList(char* list, int user_pos) {
-    char* buffer, *file = NULL;
-    int num_playlists = 0, num_songs = 0, found = 0;
+void downloadList(char* list, User* user) {
+    char* buffer = NULL;
+    Catalog* catalog;
+    PlaylistRecord* playlist;
+    int pos;
 
-    asprintf(&buffer, "\n%sNew request - %s wants to download the playlist %s.\n%s", C_GREEN, users[user_pos], list, C_RESET);
+    asprintf(&buffer, "\n%sNew request - %s wants to download the playlist %s.\n%s", C_GREEN, user->name, list, C_RESET);
     print(buffer, &terminal);
     free(buffer);
     buffer = NULL;
-    
-    asprintf(&file, "%s/playlists.txt", config.path);
-    int fd_file;
-    fd_file = open(file, O_RDONLY);
 
-    if (fd_file == -1) {
-        asprintf(&buffer,C_RED "ERROR: %s not found.\n" C_RESET, file);
-        print(buffer, &terminal);
-        free(buffer);
-        buffer = NULL;
-        asprintf(&buffer, T4_NEW_FILE, "-", 0, "-", -1);
-        pthread_mutex_lock(&socket_mu);
-        buffer = sendFrame(buffer, users_fd[user_pos], strlen(buffer));
-        pthread_mutex_unlock(&socket_mu);
+    catalog = getCatalog();
+    pos = findPlaylist(catalog, list);
+    if (pos == -1) {
+        notFound("Playlist not found\n", user);
+        releaseCatalog(catalog);
         return;
     }
 
-    readNum(fd_file, &num_playlists);
-    for (int i = 0; i < num_playlists; i++) {
-        readNum(fd_file, &num_songs);
-        readLine(fd_file, &buffer);
+    // The songs of the playlist were already looked up when the catalog was loaded
+    playlist = &catalog->playlists[pos];
+    for (uint32_t i = 0; i < playlist->num_songs; i++) {
+        PlaylistSong* song = &catalog->playlist_songs[playlist->first + i];
 
-        if (strcmp(buffer, list) == 0) {
-            found = 1;
-            free(buffer);
-            for (int j = 0; j < num_songs; j++) {
-                readLine(fd_file, &buffer);
-                downloadSong(buffer, user_pos, 1);
-                free(buffer);
-                buffer = NULL;
-            }
-            break;
+        if (song->song == -1) {
+            notFound("Song not found\n", user);
         }
-
-        free(buffer);
-        for (int j = 0; j < num_songs; j++) {
-            readLine(fd_file, &buffer);
-            free(buffer);
-            buffer = NULL;
+        else {
+            sendSong(catalog, song->song, 0, NULL, 0, 1, user);
         }
     }
-    close(fd_file);
 
-    if (found == 0) {
-        asprintf(&buffer, "Playlist not found\n");
-        print(buffer, &terminal);
-        free(buffer);
-        buffer = NULL;
-        asprintf(&buffer, T4_NEW_FILE, "-", 0, "-", -1);
-        pthread_mutex_lock(&socket_mu);
-        buffer = sendFrame(buffer, users_fd[user_pos], strlen(buffer));
-        pthread_mutex_unlock(&socket_mu);
-        return;
-    }
-    asprintf(&buffer, "Sending %s to %s. A total of %d songs will be sent\n", list, users[user_pos], num_songs);
+    asprintf(&buffer, "Sending %s to %s. A total of %u songs will be sent\n", list, user->name, playlist->num_songs);
     print(buffer, &terminal);
     free(buffer);
     buffer = NULL;
-
-    free(file);
-    file = NULL;
+    releaseCatalog(catalog);
 }
 
 /********************************************************************
  *
  * @Purpose: It finds the id received and check whether the download was successful.
+ *           Only the connection the song was sent to can check it.
  * @Parameters: header - The header of the frame received
  *              id - The id received.
- *              username - The username of the user who requested the download.
+ *              user - The user who requested the download.
  * @Return: ---.
  *
  ********************************************************************/
-void checkDownload(char* header, char* id, char* username) {
+void checkDownload(char* header, char* id, User* user) {
     char* buffer = NULL;
+    unsigned int generation = getGeneration(user->fd);
 
     pthread_mutex_lock(&globals);
-    for (int i = 0; i < num_threads; i++) {
-        if (ids[i].id == atoi(id)) {
-            if (strcmp(header, "CHECK_OK") == 0) asprintf(&buffer, "%sSuccessfully sent %s to %s\n%s", C_GREEN, ids[i].name, username, C_RESET);
-            else asprintf(&buffer, "%sError sending %s to %s\n%s", C_RED, ids[i].name, username, C_RESET);
+    for (int i = 0; i < num_ids; i++) {
+        if (ids[i].name != NULL && ids[i].id == atoi(id) && ids[i].sock == user->fd && ids[i].generation == generation) {
+            if (strcmp(header, "CHECK_OK") == 0) asprintf(&buffer, "%sSuccessfully sent %s to %s\n%s", C_GREEN, ids[i].name, user->name, C_RESET);
+            else asprintf(&buffer, "%sError sending %s to %s\n%s", C_RED, ids[i].name, user->name, C_RESET);
             
             print(buffer, &terminal);
             free(buffer);
             buffer = NULL;
+
+            // The transfer is over, its id can be given to another one once its job ends
+            if (ids[i].sending) ids[i].checked = 1;
+            else freeId(i);
             break;
         }
     }
@@ -543,36 +703,42 @@ void checkDownload(char* header, char* id, char* username) {
  *
  * @Purpose: Handles interactions with connected Bowman users, processing 
  *           requests and managing user sessions.
- * @Parameters: sock - Socket descriptor
- *              user_pos - Position in the user array
- *              users - Array of user names.
- * @Return: 0 on success, -1 on user disconnection or error.
+ * @Parameters: user - The user that sent the frame.
+ *              frame - The frame received from the user. It is freed here.
+ * @Return: 0 on success, -1 on user disconnection or error, 1 if the user
+ *          logged out and its connection is closed by the reply.
  *
  ********************************************************************/
-int bowmanHandler(int sock, int user_pos) {
-    Frame frame;
+int bowmanHandler(User* user, Frame frame) {
     char* buffer = NULL;
+    int sock = user->fd;
+
+    if (frame.type == '\0') {
+        asprintf(&buffer, "\n%sUser %s disconnected%s\n", C_RED, user->name == NULL ? "" : user->name, C_RESET);
+        print(buffer, &terminal);
+        free(buffer);
+        buffer = NULL;
+
+        frame = freeFrame(frame);
 
-    pthread_mutex_lock(&socket_mu);
-    frame = readFrame(sock);
-    pthread_mutex_unlock(&socket_mu);
-    if (frame.type == '1' && strcmp(frame.header, "NEW_BOWMAN") == 0) {
+        return -1;
+    }
+    else if (frame.type == '1' && strcmp(frame.header, "NEW_BOWMAN") == 0) {
         int found = 0;
         asprintf(&buffer, T1_OK);
-        pthread_mutex_lock(&socket_mu);
-        buffer = sendFrame(buffer, sock, strlen(buffer));
-        pthread_mutex_unlock(&socket_mu);
+        queueReply(sock, buffer, strlen(buffer), NULL, 0);
+        buffer = NULL;
         
-        users[user_pos] = getString(0, '\0', frame.data);
+        user->name = getString(0, '\0', frame.data);
 
-        for (int i = 0; i < num_users; i++) {
-            if (strcmp(users[user_pos], users[i]) == 0) {
+        for (User* aux = users; aux != NULL; aux = aux->next) {
+            if (aux->name != NULL && strcmp(user->name, aux->name) == 0) {
                 found++;
             }
         }
 
         if (found == 1) {
-            asprintf(&buffer, "%s\nNew user connected: %s.\n%s", C_GREEN, users[user_pos], C_RESET);
+            asprintf(&buffer, "%s\nNew user connected: %s.\n%s", C_GREEN, user->name, C_RESET);
             print(buffer, &terminal);
             free(buffer);
             buffer = NULL;
@@ -580,27 +746,26 @@ int bowmanHandler(int sock, int user_pos) {
     }
     else if (frame.type == '2') {
         if (strcmp(frame.header, "LIST_SONGS") == 0) {
-            listSongs(user_pos);
+            listSongs(user);
         }
         else if (strcmp(frame.header, "LIST_PLAYLISTS") == 0) {
-            listPlaylists(user_pos);
+            listPlaylists(user);
         }
     }
     else if (frame.type == '3' && strcmp(frame.header, "DOWNLOAD_SONG") == 0) {
-        downloadSong(frame.data, user_pos, 0);
+        downloadSong(frame.data, user);
     }
     else if (frame.type == '3' && strcmp(frame.header, "DOWNLOAD_LIST") == 0) {
-        downloadList(frame.data, user_pos);
+        downloadList(frame.data, user);
     }
     else if (frame.type == '5') {
-        checkDownload(frame.header, frame.data, users[user_pos]);
+        checkDownload(frame.header, frame.data, user);
     }
     
     else if (frame.type == '6' && strcmp(frame.header, "EXIT") == 0) {
+        // The connection is closed once the reply is sent
         asprintf(&buffer, T6_OK);
-        pthread_mutex_lock(&socket_mu);
-        buffer = sendFrame(buffer, sock, strlen(buffer));
-        pthread_mutex_unlock(&socket_mu);
+        queueReply(sock, buffer, strlen(buffer), NULL, 1);
         asprintf(&buffer, "\n%sUser %s disconnected%s\n", C_RED, frame.data, C_RESET);
         print(buffer, &terminal);
         free(buffer);
@@ -608,7 +773,7 @@ int bowmanHandler(int sock, int user_pos) {
 
         frame = freeFrame(frame);
         
-        return -1;
+        return 1;
     }
     else if (frame.type == '7') {
         asprintf(&buffer, "%sSent wrong frame\n%s", C_RED, C_RESET);
@@ -617,103 +782,229 @@ int bowmanHandler(int sock, int user_pos) {
     }
     else {
         print("Wrong frame\n", &terminal);
-        pthread_mutex_lock(&socket_mu);
-        sendError(sock);
-        pthread_mutex_unlock(&socket_mu);
+        asprintf(&buffer, ERROR_FRAME);
+        queueReply(sock, buffer, strlen(buffer), NULL, 0);
+        buffer = NULL;
     }
     frame = freeFrame(frame);
     return 0;
 }
 
 /********************************************************************
-*
-* @Purpose: Prepare the select.
-* @Return: the set of file descriptors.
-*
-*******************************************************************/
-fd_set buildSelect() {
-    fd_set readfds;
-    
-    FD_ZERO(&readfds);
-    FD_SET(bow_sock, &readfds);
-    for (int i = 0; i < num_users; i++) {
-        FD_SET(users_fd[i], &readfds);
+ *
+ * @Purpose: Unlinks a user from the list of users and frees it. Its
+ *           connection is closed, with the ids of the songs it will never
+ *           check, unless a reply still has to do it.
+ * @Parameters: user - The user to remove.
+ *              epoll_fd - The epoll instance.
+ *              closing - 1 to close the connection, 0 if a reply closes it.
+ * @Return: ---.
+ *
+ ********************************************************************/
+static void removeUser(User* user, int epoll_fd, int closing) {
+    unsigned int generation = getGeneration(user->fd);
+
+    if (user->prev != NULL) user->prev->next = user->next;
+    else users = user->next;
+    if (user->next != NULL) user->next->prev = user->prev;
+
+    if (closing) {
+        closeConnection(user->fd);
+        releaseIds(user->fd, generation);
+    }
+    else {
+        // The socket stays open until the reply is sent, but it is no longer read
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, user->fd, NULL);
     }
+    free(user->name);
+    free(user);
+    __atomic_sub_fetch(&num_users, 1, __ATOMIC_RELAXED);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Accepts every pending Bowman connection and registers it in
+ *           the epoll instance.
+ * @Parameters: epoll_fd - The epoll instance.
+ * @Return: 0 on success, -1 on error.
+ *
+ ********************************************************************/
+static int acceptUsers(int epoll_fd) {
+    struct epoll_event event;
+    char* buffer = NULL;
+    int fd;
+
+    // The listening socket is edge triggered, so it has to be drained
+    while ((fd = accept(bow_sock, NULL, NULL)) != -1) {
+        struct timeval timeout = {SEND_TIMEOUT, 0};
+        User* user;
 
-    return readfds;
+        // Sockets past MAX_SOCKETS have no state to queue their replies
+        if (fd >= MAX_SOCKETS) {
+            close(fd);
+            continue;
+        }
+        user = malloc(sizeof(User));
+        // A user that stops reading can't hold a worker forever
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        user->fd = fd;
+        user->name = NULL;
+        user->prev = NULL;
+        user->next = users;
+        if (users != NULL) users->prev = user;
+        users = user;
+        __atomic_add_fetch(&num_users, 1, __ATOMIC_RELAXED);
+
+        event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+        event.data.ptr = user;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            removeUser(user, epoll_fd, 1);
+        }
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        asprintf(&buffer, "%sError accepting %s socket connection\n%s", C_RED, "bowman", C_RESET);
+        print(buffer, &terminal);
+        free(buffer);
+        return -1;
+    }
+
+    return 0;
 }
 
 /********************************************************************
  *
  * @Purpose: Accepts incoming connections from Bowman users, managing users 
  *           and allocating resources.
- * @Parameters: sock - Server socket descriptor.
+ * @Parameters: ---.
  * @Return: 0 on success, -1 on error.
  *
  ********************************************************************/
 static int listenConnections() {
-    fd_set readfds;
-    users_fd = malloc(sizeof(int));
-    users = malloc(sizeof(char*));
-    char* buffer = NULL;
+    struct epoll_event event, events[EPOLL_EVENTS];
+    Frame frame;
+    int epoll_fd = epoll_create1(0);
+
+    if (epoll_fd == -1) {
+        print("Error creating epoll\n", &terminal);
+        return -1;
+    }
+
+    fcntl(bow_sock, F_SETFL, fcntl(bow_sock, F_GETFL, 0) | O_NONBLOCK);
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bow_sock, &event) == -1) {
+        print("Error in epoll\n", &terminal);
+        close(epoll_fd);
+        return -1;
+    }
 
     print("\nWaiting for connections...\n", &terminal);
     
     while (1) {
-        readfds = buildSelect();
-
-        int ready = select(CHECK_UP_TO, &readfds, NULL, NULL, NULL);
+        // Pending downloads wake the loop up to be sent to the monolith
+        int ready = epoll_wait(epoll_fd, events, EPOLL_EVENTS, batch.count > 0 ? STATS_FLUSH * 1000 : -1);
         
         if (ready == -1) {
-            print("Error in select\n", &terminal);
+            if (errno == EINTR) continue;
+            print("Error in epoll\n", &terminal);
+            close(epoll_fd);
             return -1;
         }
-        else {
-            if (FD_ISSET(bow_sock, &readfds)) {
-                users_fd[num_users] =  accept(bow_sock, NULL, NULL);
-                if (users_fd[num_users] == -1) {
-                    asprintf(&buffer, "%sError accepting %s socket connection\n%s", C_RED, "bowman", C_RESET);
-                    print(buffer, &terminal);
-                    free(buffer);
-                    buffer = NULL;
+        for (int i = 0; i < ready; i++) {
+            User* user = events[i].data.ptr;
+
+            if (user == NULL) {
+                if (acceptUsers(epoll_fd) == -1) {
+                    close(epoll_fd);
                     return -1;
                 }
-                num_users++; 
-                users = realloc(users, sizeof(char*) * num_users + 1);
-                users_fd = realloc(users_fd, sizeof(int) * (num_users + 1));
+                continue;
             }
-            for (int i = 0; i < num_users; i++) {
-                if (FD_ISSET(users_fd[i], &readfds)) {
-                    if (bowmanHandler(users_fd[i], i) == -1) {
-                        close(users_fd[i]);
-                        FD_CLR(users_fd[i], &readfds);
-                        for (int j = i; j < num_users; j++) {
-                            free(users[j]);
-                            if (j < num_users - 1) {
-                                users_fd[j] = users_fd[j + 1];
-                                users[j] = users[j + 1];    
-                            }
-                            else users[j] = NULL;
-                        }
-                        num_users--;
-                    }
+            // Edge triggered: every frame that arrived has to be consumed now
+            while (pollFrame(user->fd, &frame)) {
+                int result = bowmanHandler(user, frame);
+
+                if (result != 0) {
+                    removeUser(user, epoll_fd, result == -1);
+                    break;
                 }
             }
         }
+        if (batch.count > 0 && time(NULL) - batch.first >= STATS_FLUSH) {
+            flushRecords(&batch, poole2mono[1]);
+        }
     }
 
-    close (bow_sock);
-    for (int i = 0; i < num_users; i++) {
-        close(users_fd[i]);
+    close(epoll_fd);
+    return 0;
+}
+
+/********************************************************************
+ *
+ * @Purpose: Thread reporting the users and load of the Poole to Discovery
+ *           every LOAD_PERIOD seconds, so it can choose where to send new
+ *           Bowmans. Each report also renews the lease of the Poole.
+ * @Parameters: arg - Not used.
+ * @Return: ---.
+ *
+ *******************************************************************/
+void* reportLoad(void* arg) {
+    struct sockaddr_in discovery = configServer(config.discovery_ip, config.discovery_port);
+    struct timespec now, last;
+    uint64_t served, last_served = 0;
+    unsigned long rate;
+    double elapsed;
+    char* buffer = NULL;
+    int running, queued;
+    sigset_t set;
+
+    (void) arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    while (1) {
+        sleep(LOAD_PERIOD);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        served = __atomic_load_n(&bytes_served, __ATOMIC_RELAXED);
+        rate = elapsed > 0 ? (unsigned long) ((served - last_served) / elapsed) : 0;
+        last_served = served;
+        last = now;
+        getPoolLoad(&pool, &running, &queued);
+
+        // The connection is kept between reports, and opened again if it fails
+        if (load_sock == -1) {
+            load_sock = socket(AF_INET, SOCK_STREAM, 0);
+            if (load_sock != -1 && connect(load_sock, (struct sockaddr *) &discovery, sizeof(discovery)) < 0) {
+                close(load_sock);
+                load_sock = -1;
+            }
+            if (load_sock == -1) {
+                continue;
+            }
+        }
+
+        // Not cancelled while the connection state is locked
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        asprintf(&buffer, T1_LOAD, config.server, config.user_ip, config.user_port, __atomic_load_n(&num_users, __ATOMIC_RELAXED), running, queued, rate);
+        buffer = queueFrame(buffer, load_sock, strlen(buffer));
+        if (flushFrames(load_sock) == -1) {
+            closeConnection(load_sock);
+            load_sock = -1;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     }
 
-    return 0;
+    return NULL;
 }
 
 /********************************************************************
  *
  * @Purpose: Clean up and terminate connections in the logout process.
- *           Join threads, close Discovery and Bowman connections,
+ *           Finish the pending transfers, close Discovery and Bowman connections,
  *           and perform necessary cleanup.
  * @Parameters: ---.
  * @Return: ---.
@@ -725,12 +1016,17 @@ void logout() {
     int disc_sock;
     struct sockaddr_in discovery;
 
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+    if (reporting) {
+        pthread_cancel(reporter);
+        pthread_join(reporter, NULL);
+        reporting = 0;
+    }
+    destroyPool(&pool);
+    destroyPool(&replies);
+    for (int i = 0; i < num_ids; i++) {
         free(ids[i].name);
         ids[i].name = NULL;
     }
-    free(threads);
     free(ids);
 
     // Close Discovery connection
@@ -755,13 +1051,7 @@ void logout() {
     }
 
     asprintf(&buffer, T6_POOLE, config.server);
-    pthread_mutex_lock(&socket_mu);
-    buffer = sendFrame(buffer, disc_sock, strlen(buffer));
-    pthread_mutex_unlock(&socket_mu);
-
-    pthread_mutex_lock(&socket_mu);
-    frame = readFrame(disc_sock);
-    pthread_mutex_unlock(&socket_mu);
+    frame = negotiateFrame(buffer, disc_sock, strlen(buffer));
 
     if (frame.type == '6' && strcmp(frame.header, "CON_OK") == 0) {
         asprintf(&buffer, "%sSuccessfully aborted\n%s", C_GREEN, C_RESET);
@@ -776,157 +1066,103 @@ void logout() {
         buffer = NULL;
     }
     frame = freeFrame(frame);
-    close(disc_sock);
+    closeConnection(disc_sock);
+    // Closed after SHUTDOWN, otherwise Discovery would take it as a crash
+    if (load_sock != -1) {
+        closeConnection(load_sock);
+        load_sock = -1;
+    }
 
     // Close Bowman connections
     if (num_users != 0) {
-        for (int i = 0; i < num_users; i++) {
+        while (users != NULL) {
             asprintf(&buffer, T6_POOLE, config.server);
-            pthread_mutex_lock(&socket_mu);
-            buffer = sendFrame(buffer, users_fd[i], strlen(buffer));
-            pthread_mutex_unlock(&socket_mu);
+            lockConnection(users->fd);
+            buffer = sendFrame(buffer, users->fd, strlen(buffer));
+            unlockConnection(users->fd);
 
-            pthread_mutex_lock(&socket_mu);
-            frame = readFrame(users_fd[i]);
-            pthread_mutex_unlock(&socket_mu);
+            frame = readFrame(users->fd);
 
             if (frame.type == '6' && strcmp(frame.header, "CON_OK") == 0) {
-                asprintf(&buffer, "%sDisconnected user %s\n%s", C_GREEN, users[i], C_RESET);
+                asprintf(&buffer, "%sDisconnected user %s\n%s", C_GREEN, users->name, C_RESET);
                 print(buffer, &terminal);
                 free(buffer);
                 buffer = NULL;
             }
             else {
-                asprintf(&buffer, "%sCouldn't close %s user connection\n%s", C_RED, users[i], C_RESET);
+                asprintf(&buffer, "%sCouldn't close %s user connection\n%s", C_RED, users->name, C_RESET);
                 print(buffer, &terminal);
                 free(buffer);
                 buffer = NULL;
             }
-            close(users_fd[i]);
-            free(users[i]);
-            users[i] = NULL;
+            removeUser(users, -1, 1);
             frame = freeFrame(frame);
         }
     }
-    close(bow_sock);
-    write(poole2mono[1], "\n", 1);
-    wait(NULL);
+    closeConnection(bow_sock);
+    // The monolith stops once it has read everything left in the pipe
+    flushRecords(&batch, poole2mono[1]);
     close(poole2mono[1]);
+    wait(NULL);
 }
 
 /********************************************************************
  *
- * @Purpose: Reads sent data from a pipe and updates statistics from stats.txt.
+ * @Purpose: Reads the batches of downloads sent by Poole and counts them in
+ *           the shared stats table, exporting it to stats.txt periodically.
  * @Parameters: ---.
  * @Return: ---.
  *
  *******************************************************************/
 void monolith() {
-    char *buffer = NULL, *aux = NULL;
-    int i = 0, found = 0, num = 0;
+    StatRecord records[STATS_BATCH];
+    size_t used = 0, num_records;
+    ssize_t bytes;
+    int ready;
+    uint64_t exported = 0, total;
+    time_t next_export = time(NULL) + STATS_EXPORT;
+    struct timeval timeout;
+    fd_set set;
     
-    //create shared semaphore
-    semaphore* sem = malloc(sizeof(semaphore));
-    key_t key = ftok("poole.c", 11);
-
-    if (key == -1) {
-        asprintf(&buffer, "%sError creating the key\n%s", C_RED, C_RESET);
-        print(buffer, &terminal);
-        free(buffer);
-        return;
-    }
-    SEM_constructor_with_name(sem, key);
-    SEM_init(sem, 1);
-
-    SEM_wait(sem);
-    int file_fd = open("stats.txt", O_CREAT | O_RDWR, 0666);
+    while (1) {
+        FD_ZERO(&set);
+        FD_SET(poole2mono[0], &set);
+        timeout.tv_sec = STATS_EXPORT;
+        timeout.tv_usec = 0;
+        ready = select(poole2mono[0] + 1, &set, NULL, NULL, &timeout);
 
-    if (file_fd == -1) {
-        asprintf(&buffer, "%sError opening stats.txt\n%s", C_RED, C_RESET);
-        print(buffer, &terminal);
-        free(buffer);
-        SEM_signal(sem);
-        SEM_destructor(sem);
-        free(sem);
-        return;
-    }
+        if (ready > 0) {
+            bytes = read(poole2mono[0], (char*) records + used, sizeof(records) - used);
 
-    if (lseek(file_fd, 0, SEEK_END) == 0) {
-        asprintf(&buffer, "0\n");
-        write(file_fd, buffer, strlen(buffer));
-    }
-    SEM_signal(sem);
-    
-    while (1) {
-        i = 0;
-        found = 0;
-        num = 0;
-        free(buffer);
-        buffer = NULL;
-        do {
-            buffer = realloc(buffer, i + 1);
-            read(poole2mono[0], buffer + i, 1);
-            
-            if (buffer[i] == '\n') {
-                free(buffer);
-                close(file_fd);
+            // Poole closed the pipe, everything it sent was already read
+            if (bytes == 0 || (bytes == -1 && errno != EINTR)) {
                 close(poole2mono[0]);
-                SEM_destructor(sem);
-                free(sem);
+                if (stats != NULL) {
+                    exportStats(stats);
+                    closeStats(stats);
+                }
                 exit(0);
             }
-            i++;
-        } while (buffer[i - 1] != '\0');
-        i--;
-
-        SEM_wait(sem);
-        lseek(file_fd, 0, SEEK_SET);
-        aux = readUntil(file_fd, '\n');
-        while (found == 0 && aux != NULL) {
-            for (int j = 0; j < i && i <= (int)strlen(aux); j++) {
-                if (buffer[j] == aux[j]) {
-                    found++;
+            if (bytes > 0) {
+                used += bytes;
+                num_records = used / sizeof(StatRecord);
+                for (size_t i = 0; i < num_records && stats != NULL; i++) {
+                    addDownloads(stats, records[i].song, 1, records[i].bytes, records[i].time);
                 }
+                // A record cut by the read is completed by the next one
+                used -= num_records * sizeof(StatRecord);
+                memmove(records, records + num_records, used);
             }
-            
-            if (found == i) {
-                found = 1;
-                break;
-            } else found = 0;
-            
-            free(aux);
-            aux = readUntil(file_fd, '\n');
         }
-        
-        if (found == 1) {
-            int j = strlen(aux) - 1;
-            int multi = 1;
-            while (aux[j] >= '0' && aux[j] <= '9') {
-                if ( (strlen(aux) - 1 - j) == 0) multi = 1;
-                else multi *= 10;
-                num += (aux[j] - '0') * multi;
-                j--;
+
+        // Other Pooles count in the same table, so their downloads are exported too
+        if (stats != NULL && time(NULL) >= next_export) {
+            total = __atomic_load_n(&stats->total, __ATOMIC_RELAXED);
+            if (total != exported && exportStats(stats) == 0) {
+                exported = total;
             }
-            lseek(file_fd, - (strlen(aux) + 1), SEEK_CUR);
-            free(aux);
-            asprintf(&aux, "%s %d\n", buffer, num + 1);
-            write(file_fd, aux, strlen(aux));
-        } else {
-            free(aux);
-            lseek(file_fd, 0, SEEK_END);
-            asprintf(&aux, "%s 1\n", buffer);
-            write(file_fd, aux, strlen(aux));
+            next_export = time(NULL) + STATS_EXPORT;
         }
-        free(aux);
-        lseek(file_fd, 0, SEEK_SET);
-        aux = readUntil(file_fd, '\n');
-        num = atoi(aux);
-        free(aux);
-        lseek(file_fd, 0, SEEK_SET);
-        asprintf(&aux, "%d\n", num + 1);
-        write(file_fd, aux, strlen(aux));
-        free(aux);
-        SEM_signal(sem);
     }
 }
 
@@ -942,8 +1178,8 @@ void sig_handler(int sigsum) {
         case SIGINT:
             print("\nAborting...\n", &terminal);
             logout();
-            free(users);
-            free(users_fd);
+            freeChecksums();
+            stopCatalog();
             free(config.server);
             free(config.path);
             free(config.discovery_ip);
@@ -998,6 +1234,15 @@ int main(int argc, char *argv[]) {
 
         return -1;
     }
+    // Mapped before the fork, so Poole and the monolith share it
+    stats = openStats();
+    if (stats == NULL) {
+        asprintf(&buffer, "%sError opening %s\n%s", C_RED, STATS_FILE, C_RESET);
+        print(buffer, &terminal);
+        free(buffer);
+        buffer = NULL;
+    }
+
         switch (fork()){
             case -1:
                 asprintf(&buffer, "%sError creating the process\n%s", C_RED, C_RESET);
@@ -1045,16 +1290,10 @@ int main(int argc, char *argv[]) {
     }
 
     asprintf(&buffer, T1_POOLE, config.server, config.user_ip, config.user_port);
-    pthread_mutex_lock(&socket_mu);
-    buffer = sendFrame(buffer, disc_sock, strlen(buffer));
-    pthread_mutex_unlock(&socket_mu);
-
-    pthread_mutex_lock(&socket_mu);
-    frame = readFrame(disc_sock);
-    pthread_mutex_unlock(&socket_mu);
+    frame = negotiateFrame(buffer, disc_sock, strlen(buffer));
 
     if (frame.type == '1' && strcmp(frame.header, "CON_OK") == 0) {
-        close(disc_sock);
+        closeConnection(disc_sock);
         frame = freeFrame(frame);
         server = configServer(config.user_ip, config.user_port);
         
@@ -1073,6 +1312,26 @@ int main(int argc, char *argv[]) {
         free(buffer);
         buffer = NULL;
 
+        loadChecksums(config.path);
+        if (initCatalog(config.path) == -1) {
+            asprintf(&buffer, "%sChanges on the songs and playlists won't be reloaded\n%s", C_RED, C_RESET);
+            print(buffer, &terminal);
+            free(buffer);
+            buffer = NULL;
+        }
+
+        srand(getpid());
+        if (initPool(&pool, config.workers) == -1 || initPool(&replies, REPLY_WORKERS) == -1) {
+            asprintf(&buffer, "%sError creating the transfer workers\n%s", C_RED, C_RESET);
+            print(buffer, &terminal);
+            free(buffer);
+
+            return -1;
+        }
+        if (pthread_create(&reporter, NULL, reportLoad, NULL) == 0) {
+            reporting = 1;
+        }
+
         if (listenConnections() == -1) {
             return -1;
         }
@@ -1082,7 +1341,7 @@ int main(int argc, char *argv[]) {
         asprintf(&buffer, "%sError trying to connect to HAL 9000 system\n%s", C_RED, C_RESET);
         print(buffer, &terminal);
         free(buffer);
-        close(disc_sock);
+        closeConnection(disc_sock);
         
         return -1;
     } 
@@ -0,0 +1,60 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - Chunk Ring
+ * @Authors: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains the functions of the bounded ring passing the chunks
+ *   of the files being downloaded from the reading thread to the writing one.
+ *
+ ********************************************************************/
+#include "ring.h"
+
+int initRing(Ring* ring) {
+    ring->head = 0;
+    ring->tail = 0;
+
+    if (sem_init(&ring->used, 0, 0) == -1) {
+        return -1;
+    }
+    if (sem_init(&ring->free, 0, RING_SLOTS) == -1) {
+        sem_destroy(&ring->used);
+        return -1;
+    }
+
+    return 0;
+}
+
+void pushChunk(Ring* ring, Chunk chunk) {
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    // Blocks the reader when the writer falls behind
+    while (sem_wait(&ring->free) == -1 && errno == EINTR);
+
+    ring->slots[tail % RING_SLOTS] = chunk;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    sem_post(&ring->used);
+}
+
+Chunk popChunk(Ring* ring) {
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    Chunk chunk;
+
+    while (sem_wait(&ring->used) == -1 && errno == EINTR);
+
+    chunk = ring->slots[head % RING_SLOTS];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    sem_post(&ring->free);
+
+    return chunk;
+}
+
+void destroyRing(Ring* ring) {
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    for (unsigned int i = ring->head; i != tail; i++) {
+        free(ring->slots[i % RING_SLOTS].block);
+    }
+    ring->head = tail;
+    sem_destroy(&ring->used);
+    sem_destroy(&ring->free);
+}
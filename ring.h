@@ -0,0 +1,79 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - Chunk Ring
+ * @Author: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains function declarations and structs definitions used
+ *   for handing the received file chunks from one thread to another.
+ ********************************************************************/
+#ifndef _RING_H_
+#define _RING_H_
+
+#include "functions.h"
+
+#define RING_SLOTS 256
+
+/**
+ * Structure for storing a chunk of a file. The data points inside the
+ * block, which is freed once the chunk has been written.
+*/
+typedef struct {
+    int id;
+    int length;
+    char* data;
+    char* block;
+} Chunk;
+
+/**
+ * Structure for storing a single producer, single consumer ring of chunks.
+ * The producer only moves the tail and the consumer only moves the head,
+ * the semaphores are only waited on when the ring is full or empty.
+*/
+typedef struct {
+    Chunk slots[RING_SLOTS];
+    unsigned int head;
+    unsigned int tail;
+    sem_t used;
+    sem_t free;
+} Ring;
+
+/********************************************************************
+ *
+ * @Purpose: Initializes an empty ring.
+ * @Parameters: ring - The ring to initialize.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+int initRing(Ring* ring);
+
+/********************************************************************
+ *
+ * @Purpose: Adds a chunk to the ring, waiting while the ring is full.
+ *           Only one thread may push.
+ * @Parameters: ring - The ring.
+ *              chunk - The chunk to add.
+ * @Return: ---
+ *
+ ********************************************************************/
+void pushChunk(Ring* ring, Chunk chunk);
+
+/********************************************************************
+ *
+ * @Purpose: Takes the oldest chunk of the ring, waiting while the ring is empty.
+ *           Only one thread may pop.
+ * @Parameters: ring - The ring.
+ * @Return: The chunk.
+ *
+ ********************************************************************/
+Chunk popChunk(Ring* ring);
+
+/********************************************************************
+ *
+ * @Purpose: Frees the chunks left in the ring and its semaphores.
+ * @Parameters: ring - The ring.
+ * @Return: ---
+ *
+ ********************************************************************/
+void destroyRing(Ring* ring);
+
+#endif
@@ -0,0 +1,221 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - Download Statistics
+ * @Authors: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains the functions to count the downloads of every Poole
+ *   of the host in a hash table kept in a shared mapped file.
+ *
+ * - Slots are claimed with a compare and swap and counts are added with
+ *   atomic increments, so no process ever waits for a lock. stats.txt is
+ *   only a snapshot of the table.
+ *
+ ********************************************************************/
+#include "stats.h"
+
+/********************************************************************
+ *
+ * @Purpose: Adds the counts of the old stats.txt to a new table.
+ * @Parameters: stats - The table.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void importStats(Stats* stats) {
+    Reader reader;
+    struct stat st;
+    char* line;
+    int fd;
+
+    fd = open(STATS_TEXT, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return;
+    }
+    initReader(&reader, fd);
+
+    // The first line is the total, the others "<song> <downloads>"
+    readerLine(&reader, &line);
+    free(line);
+    while (readerOffset(&reader) < st.st_size) {
+        char* count;
+
+        readerLine(&reader, &line);
+        count = strrchr(line, ' ');
+        if (count != NULL && count != line && atoll(count + 1) > 0) {
+            addDownloads(stats, findSlot(stats, line, count - line), atoll(count + 1), 0, 0);
+        }
+        free(line);
+    }
+    close(fd);
+}
+
+/********************************************************************
+ *
+ * @Purpose: Appends a line to a text, growing it by doubling.
+ * @Parameters: text - The text.
+ *              length - Length of the text.
+ *              capacity - Bytes allocated for the text.
+ *              line - The line. It is freed.
+ *              line_length - Length of the line.
+ * @Return: ---
+ *
+ ********************************************************************/
+static void appendLine(char** text, size_t* length, size_t* capacity, char* line, int line_length) {
+    if (*length + line_length > *capacity) {
+        *capacity = *capacity == 0 ? 4096 : *capacity;
+        while (*length + line_length > *capacity) *capacity *= 2;
+        *text = realloc(*text, *capacity);
+    }
+    memcpy(*text + *length, line, line_length);
+    *length += line_length;
+    free(line);
+}
+
+Stats* openStats() {
+    Stats* stats;
+    struct stat st;
+    uint64_t expected = 0, format = ((uint64_t) STATS_SLOTS << 32) | sizeof(StatSlot);
+    int fd;
+
+    fd = open(STATS_FILE, O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+    // Every Poole may grow it at once, the new bytes are zeros either way
+    if (fstat(fd, &st) == -1 || (st.st_size < (off_t) sizeof(Stats) && ftruncate(fd, sizeof(Stats)) == -1)) {
+        close(fd);
+        return NULL;
+    }
+    stats = mmap(NULL, sizeof(Stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Only the process creating the table imports the old counts
+    if (__atomic_compare_exchange_n(&stats->format, &expected, format, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        importStats(stats);
+    }
+    else if (expected != format) {
+        // A table with other slots
+        munmap(stats, sizeof(Stats));
+        return NULL;
+    }
+
+    return stats;
+}
+
+uint32_t findSlot(Stats* stats, const char* name, int length) {
+    uint32_t hash = hashName(name, length);
+
+    if (length > STATS_NAME - 1) length = STATS_NAME - 1;
+
+    for (uint32_t i = 0; i < STATS_SLOTS; i++) {
+        uint32_t pos = (hash + i) & (STATS_SLOTS - 1);
+        StatSlot* slot = &stats->slot[pos];
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if (state == SLOT_EMPTY) {
+            if (__atomic_compare_exchange_n(&slot->state, &state, SLOT_WRITING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                slot->hash = hash;
+                memcpy(slot->name, name, length);
+                slot->name[length] = '\0';
+                __atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+                state = SLOT_READY;
+            }
+        }
+        // Another process is writing the name of this slot
+        for (int wait = 0; state == SLOT_WRITING && wait < STATS_WAIT; wait++) {
+            sched_yield();
+            state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        }
+        if (state != SLOT_READY) {
+            continue;
+        }
+
+        if (slot->hash == hash && memcmp(slot->name, name, length) == 0 && slot->name[length] == '\0') {
+            return pos;
+        }
+    }
+
+    return STATS_LOST;
+}
+
+void addDownloads(Stats* stats, uint32_t song, uint64_t count, uint64_t bytes, uint64_t time) {
+    // Downloads without a slot still count in the total
+    if (song >= STATS_SLOTS) {
+        __atomic_add_fetch(&stats->lost, count, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_add_fetch(&stats->slot[song].count, count, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->slot[song].bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->slot[song].last, time, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&stats->total, count, __ATOMIC_RELAXED);
+}
+
+void addRecord(StatBatch* batch, int fd, uint32_t song, uint64_t bytes) {
+    StatRecord* record = &batch->records[batch->count];
+
+    record->song = song;
+    record->time = time(NULL);
+    record->bytes = bytes;
+    if (batch->count == 0) batch->first = record->time;
+    batch->count++;
+
+    if (batch->count == (int) STATS_BATCH) {
+        flushRecords(batch, fd);
+    }
+}
+
+void flushRecords(StatBatch* batch, int fd) {
+    if (batch->count > 0) {
+        write(fd, batch->records, sizeof(StatRecord) * batch->count);
+        batch->count = 0;
+    }
+}
+
+int exportStats(Stats* stats) {
+    char* text = NULL, *line = NULL, *tmp = NULL;
+    size_t length = 0, capacity = 0, written = 0;
+    ssize_t bytes = 0;
+    int fd, line_length;
+
+    line_length = asprintf(&line, "%lu\n", (unsigned long) __atomic_load_n(&stats->total, __ATOMIC_RELAXED));
+    appendLine(&text, &length, &capacity, line, line_length);
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        StatSlot* slot = &stats->slot[i];
+
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == SLOT_READY) {
+            line_length = asprintf(&line, "%s %lu\n", slot->name, (unsigned long) __atomic_load_n(&slot->count, __ATOMIC_RELAXED));
+            appendLine(&text, &length, &capacity, line, line_length);
+        }
+    }
+
+    // Written aside and renamed, so readers never see half a snapshot
+    asprintf(&tmp, ".%s.%d", STATS_TEXT, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd != -1) {
+        while (written < length && (bytes = write(fd, text + written, length - written)) > 0) {
+            written += bytes;
+        }
+        close(fd);
+    }
+    if (fd == -1 || written != length || rename(tmp, STATS_TEXT) == -1) {
+        unlink(tmp);
+        free(tmp);
+        free(text);
+        return -1;
+    }
+    free(tmp);
+    free(text);
+
+    return 0;
+}
+
+void closeStats(Stats* stats) {
+    munmap(stats, sizeof(Stats));
+}
@@ -0,0 +1,150 @@
+/********************************************************************
+ *
+ * @Purpose: HAL 9000 System - Download Statistics
+ * @Author: Marc Escoté Llopis & Adrián Jorge Sánchez López
+ *
+ * - This file contains function declarations and structs definitions used
+ *   for counting the downloads of every Poole of the host in a table shared
+ *   through a mapped file.
+ ********************************************************************/
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "functions.h"
+
+#define STATS_FILE "stats.bin"
+#define STATS_TEXT "stats.txt"
+#define STATS_SLOTS 8192
+#define STATS_NAME 256
+#define STATS_EXPORT 5
+#define STATS_FLUSH 1
+#define STATS_BATCH (PIPE_BUF / sizeof(StatRecord))
+#define STATS_LOST UINT32_MAX
+#define STATS_WAIT 10000
+
+#define SLOT_EMPTY 0
+#define SLOT_WRITING 1
+#define SLOT_READY 2
+
+/**
+ * Structure for storing the downloads of a song. The name is only read once
+ * the slot is ready, and it never changes after that.
+*/
+typedef struct {
+    uint32_t state;
+    uint32_t hash;
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t last;
+    char name[STATS_NAME];
+} StatSlot;
+
+/**
+ * Structure for storing the table of downloads, with open addressing.
+ * Every field is updated with atomic operations, so any process with the
+ * file mapped can count downloads without locks.
+*/
+typedef struct {
+    uint64_t format;
+    uint64_t total;
+    uint64_t lost;
+    StatSlot slot[STATS_SLOTS];
+} Stats;
+
+/**
+ * Structure for a download sent from Poole to the monolith: the slot of the
+ * song in the table (STATS_LOST if it is full), the bytes and when it started.
+*/
+typedef struct {
+    uint32_t song;
+    uint32_t time;
+    uint64_t bytes;
+} StatRecord;
+
+/**
+ * Structure for the downloads Poole has not sent to the monolith yet.
+ * A full batch fits in a single atomic write to the pipe.
+*/
+typedef struct {
+    StatRecord records[STATS_BATCH];
+    int count;
+    time_t first;
+} StatBatch;
+
+/********************************************************************
+ *
+ * @Purpose: Maps the shared table of downloads, creating it if needed.
+ *           A new table starts with the counts of stats.txt.
+ * @Parameters: ---
+ * @Return: The table, NULL on error.
+ *
+ ********************************************************************/
+Stats* openStats();
+
+/********************************************************************
+ *
+ * @Purpose: Finds the slot of a song in the table, taking a new one for it
+ *           if it has none yet. A slot still being written after STATS_WAIT
+ *           yields is skipped, its process may have died while claiming it.
+ * @Parameters: stats - The table.
+ *              name - The name of the song.
+ *              length - Length of the name.
+ * @Return: The slot, STATS_LOST if the table is full.
+ *
+ ********************************************************************/
+uint32_t findSlot(Stats* stats, const char* name, int length);
+
+/********************************************************************
+ *
+ * @Purpose: Adds downloads of a song to the table.
+ * @Parameters: stats - The table.
+ *              song - The slot of the song, STATS_LOST if it has none.
+ *              count - Number of downloads.
+ *              bytes - Bytes downloaded.
+ *              time - When the last download started.
+ * @Return: ---
+ *
+ ********************************************************************/
+void addDownloads(Stats* stats, uint32_t song, uint64_t count, uint64_t bytes, uint64_t time);
+
+/********************************************************************
+ *
+ * @Purpose: Adds a download to a batch, sending the batch if it gets full.
+ * @Parameters: batch - The batch.
+ *              fd - The pipe to the monolith.
+ *              song - The slot of the song.
+ *              bytes - Size of the song.
+ * @Return: ---
+ *
+ ********************************************************************/
+void addRecord(StatBatch* batch, int fd, uint32_t song, uint64_t bytes);
+
+/********************************************************************
+ *
+ * @Purpose: Sends the downloads of a batch with a single write.
+ * @Parameters: batch - The batch.
+ *              fd - The pipe to the monolith.
+ * @Return: ---
+ *
+ ********************************************************************/
+void flushRecords(StatBatch* batch, int fd);
+
+/********************************************************************
+ *
+ * @Purpose: Writes a snapshot of the table to stats.txt, replacing it at once.
+ * @Parameters: stats - The table.
+ * @Return: 0 if successful, -1 otherwise.
+ *
+ ********************************************************************/
+int exportStats(Stats* stats);
+
+/********************************************************************
+ *
+ * @Purpose: Unmaps the table. The counts stay in the file.
+ * @Parameters: stats - The table.
+ * @Return: ---
+ *
+ ********************************************************************/
+void closeStats(Stats* stats);
+
+#endif